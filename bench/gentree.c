@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+
+/*
+ * Synthetic trees for bench/run.sh:
+ *
+ *   gentree flat N DIR     N regular files
+ *   gentree deep N DIR     N directories, 8 per level, 16 files in each
+ *   gentree links N DIR    N symlinks, every 16th one dangling
+ *   gentree owners N DIR   N files spread over 1000 uids and gids (root only)
+ *
+ * Sizes (sparse) and mtimes are pseudo random but fixed, so -t and -S have
+ * real work to do and runs over regenerated trees stay comparable.
+ */
+
+#define DEEP_FANOUT 8
+#define DEEP_FILES 16
+#define LINK_DANGLING 16
+#define OWNERS 1000
+#define OWNER_BASE 100000
+
+static uint64_t g_seed = 88172645463325252ULL;
+
+static uint64_t next_rand(void) {
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 7;
+    g_seed ^= g_seed << 17;
+    return g_seed;
+}
+
+/* distinct names in no particular order, as in a directory that grew */
+static uint32_t scramble(long i) {
+    return (uint32_t)i * 2654435761u;
+}
+
+static void die(const char *what, const char *name) {
+    fprintf(stderr, "gentree: %s %s: %s\n", what, name, strerror(errno));
+    exit(1);
+}
+
+static int mkfile(int dirfd, const char *name) {
+    struct timespec ts[2];
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1) die("can not create", name);
+    if (ftruncate(fd, next_rand() % (4 * 1024 * 1024)) != 0) {
+        die("can not resize", name);
+    }
+    ts[0].tv_sec = ts[1].tv_sec = 1000000000 + next_rand() % 700000000;
+    ts[0].tv_nsec = ts[1].tv_nsec = next_rand() % 1000000000;
+    if (futimens(fd, ts) != 0) die("can not set times of", name);
+    return fd;
+}
+
+static void gen_flat(int dirfd, long n) {
+    char name[32];
+    long i;
+
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "f%08x", scramble(i));
+        close(mkfile(dirfd, name));
+    }
+}
+
+/* directory number i of the tree holds DEEP_FILES files and its children */
+static void gen_deep(int dirfd, long i, long n) {
+    char name[32];
+    long c;
+    int fd;
+
+    for (c = 0; c < DEEP_FILES; c++) {
+        snprintf(name, sizeof(name), "f%02ld", c);
+        close(mkfile(dirfd, name));
+    }
+    for (c = i * DEEP_FANOUT + 1; c <= i * DEEP_FANOUT + DEEP_FANOUT && c < n;
+         c++) {
+        snprintf(name, sizeof(name), "d%ld", c);
+        if (mkdirat(dirfd, name, 0755) != 0) die("can not create", name);
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) die("can not open", name);
+        gen_deep(fd, c, n);
+        close(fd);
+    }
+}
+
+static void gen_links(int dirfd, long n) {
+    char name[32], target[32];
+    long i;
+
+    close(mkfile(dirfd, "target"));
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "l%08x", scramble(i));
+        snprintf(target, sizeof(target), i % LINK_DANGLING ? "target" :
+                 "missing%ld", i);
+        if (symlinkat(target, dirfd, name) != 0) die("can not create", name);
+    }
+}
+
+static void gen_owners(int dirfd, long n) {
+    char name[32];
+    long i;
+    int fd, warned = 0;
+
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "o%08x", scramble(i));
+        fd = mkfile(dirfd, name);
+        if (fchown(fd, OWNER_BASE + i % OWNERS,
+                   OWNER_BASE + (i * 7) % OWNERS) != 0 && !warned) {
+            fprintf(stderr, "gentree: can not chown, files keep their owner: "
+                    "%s\n", strerror(errno));
+            warned = 1;
+        }
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    long n;
+    int fd;
+
+    if (argc != 4 || (n = atol(argv[2])) <= 0) {
+        fprintf(stderr, "Usage: gentree flat|deep|links|owners N DIR\n");
+        return 1;
+    }
+    if (mkdir(argv[3], 0755) != 0 && errno != EEXIST) {
+        die("can not create", argv[3]);
+    }
+    fd = open(argv[3], O_RDONLY | O_DIRECTORY);
+    if (fd == -1) die("can not open", argv[3]);
+    if (strcmp(argv[1], "flat") == 0) {
+        gen_flat(fd, n);
+    } else if (strcmp(argv[1], "deep") == 0) {
+        gen_deep(fd, 0, n);
+    } else if (strcmp(argv[1], "links") == 0) {
+        gen_links(fd, n);
+    } else if (strcmp(argv[1], "owners") == 0) {
+        gen_owners(fd, n);
+    } else {
+        fprintf(stderr, "gentree: unknown tree %s\n", argv[1]);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
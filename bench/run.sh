@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# make bench: time ls over synthetic trees, phase by phase.
+#
+# Each tree is listed in a set of modes, RUNS times with a warm page cache
+# and, when /proc/sys/vm/drop_caches is writable (root), RUNS times cold.
+# A line shows the best wall time of the runs and the best wall time of
+# each phase --stats reports (read, stat, sort, owner, time, format, write).
+#
+#   BENCH_DIR    where the trees are generated and kept (/tmp/ls-bench)
+#   BENCH_SIZES  entries of the flat trees ("10000 1000000", add 5000000)
+#   BENCH_RUNS   runs per mode and cache state (5)
+#   BENCH_BASE   a git revision to build and time next to the working tree,
+#                revisions without --stats only report wall times
+#   BENCH_MODES  override the options timed on flat trees, ';' separated
+
+set -e
+
+cd "$(dirname "$0")/.."
+root=${BENCH_DIR:-/tmp/ls-bench}
+sizes=${BENCH_SIZES:-"10000 1000000"}
+runs=${BENCH_RUNS:-5}
+modes=${BENCH_MODES:-"-1;-1 -U;;-U;-t;-S;-r;-h;--head=100;--io-uring;--jobs=1;--format=ndjson;-1 --cache=$root/cache"}
+out=$root/out
+mkdir -p "$root" "$root/cache"
+
+tree() { # kind n: generate the tree once, print its path
+    if [ ! -e "$root/$1-$2.done" ]; then
+        echo "generating $1 tree of $2 ..." >&2
+        rm -rf "$root/$1-$2"
+        bench/gentree "$1" "$2" "$root/$1-$2"
+        touch "$root/$1-$2.done"
+    fi
+    echo "$root/$1-$2"
+}
+
+cold() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+}
+
+bins="working:./ls"
+if [ -n "$BENCH_BASE" ]; then
+    git show "$BENCH_BASE:ls.c" > "$root/ls-base.c"
+    gcc -O2 -pthread -o "$root/ls-base" "$root/ls-base.c"
+    bins="$bins $BENCH_BASE:$root/ls-base"
+fi
+states=warm
+if [ -w /proc/sys/vm/drop_caches ]; then
+    states="cold warm"
+else
+    echo "not root, skipping cold cache runs" >&2
+fi
+
+# bin label dir opts stats: RUNS runs in each cache state, one summary line each
+measure() {
+    for state in $states; do
+        rm -f "$root"/cache/*
+        i=0
+        : > "$root/times"
+        while [ $i -lt "$runs" ]; do
+            [ "$state" = cold ] && cold
+            start=$(date +%s%N)
+            # shellcheck disable=SC2086
+            if ! "$1" $4 $5 "$3" > "$out" 2> "$root/err" ||
+               grep -q '^Usage: ls' "$out"; then # an option it doesn't know
+                echo "n/a" > "$root/times"
+                break
+            fi
+            end=$(date +%s%N)
+            echo "wall $(( (end - start) / 1000 ))" \
+                 "$(awk '$1 == "total" { exit }
+                     $1 == "phase" { p = 1; next }
+                     p { printf " %s %s", $1, $2 }' "$root/err")" \
+                 >> "$root/times"
+            i=$((i + 1))
+        done
+        awk -v label="$2" -v state="$state" '
+            /^n\/a/ { na = 1 }
+            {
+                for (i = 1; i < NF; i += 2) {
+                    v = $(i + 1) / ($i == "wall" ? 1000 : 1)
+                    if (!($i in best) || v < best[$i]) best[$i] = v
+                    if (!seen[$i]++) keys[nk++] = $i
+                }
+            }
+            END {
+                line = sprintf("%-48s %-4s", label, state)
+                if (na) { print line "  n/a"; exit }
+                for (k = 0; k < nk; k++)
+                    line = line sprintf("  %s %.2f", keys[k], best[keys[k]])
+                print line " ms"
+            }' "$root/times"
+    done
+}
+
+for b in $bins; do
+    name=${b%%:*}
+    bin=${b#*:}
+    stats=--stats
+    if "$bin" --stats /dev/null 2>&1 | grep -q '^Usage: ls'; then
+        stats=
+    fi
+    echo "== $name"
+    for n in $sizes; do
+        dir=$(tree flat "$n")
+        old_ifs=$IFS
+        IFS=';'
+        for m in $modes; do
+            IFS=$old_ifs
+            measure "$bin" "flat $n ${m:-(long)}" "$dir" "$m" "$stats"
+        done
+        IFS=$old_ifs
+    done
+    dir=$(tree deep 20000)
+    for m in "-R -1" "-R" "-s" "-R --io-uring"; do
+        measure "$bin" "deep 20000 $m" "$dir" "$m" "$stats"
+    done
+    dir=$(tree links 100000)
+    for m in "" "-L" "-F"; do
+        measure "$bin" "links 100000 ${m:-(long)}" "$dir" "$m" "$stats"
+    done
+    dir=$(tree owners 100000)
+    for m in "" "--format=ndjson --owner-names"; do
+        measure "$bin" "owners 100000 ${m:-(long)}" "$dir" "$m" "$stats"
+    done
+done
@@ -1,9 +1,11 @@
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -11,6 +13,23 @@
 #include <grp.h>
 #include <time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <fnmatch.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #define MAXLINE 2048
 #define DEFAULT_PERM "----------"
@@ -18,362 +37,4689 @@
 #define ONE_MB (ONE_KB * ONE_KB)
 #define ONE_GB (ONE_MB * ONE_KB)
 
+/* size of the getdents64 buffer, build with -DDENTS_BUFSIZE=... to tune */
+#ifndef DENTS_BUFSIZE
+#define DENTS_BUFSIZE ONE_MB
+#endif
+
+#define OUTBUF_SIZE (256 * ONE_KB)
+
+#define ARENA_BLOCK (64 * ONE_KB) /* first block of a listing's arena */
+#define NODE_ARENA_BLOCK (4 * ONE_KB) /* first block of a -R directory */
+#define ARENA_MAX_BLOCK (16 * ONE_MB) /* blocks double up to this size */
+
+#define KEY_SORT_MIN 48 /* shorter runs are insertion sorted */
+
+#define CLASSIFY_TYPE 1 /* indicator for the file type only */
+#define CLASSIFY_EXEC 2 /* also mark executable files with '*' */
+
+#define FMT_TEXT 0
+#define FMT_NDJSON 1 /* a JSON object per line */
+#define FMT_BINARY 2 /* struct bin_rec_t records */
+
+#define SORT_NAME 0 /* g_args.sortkey, ties are always in name order */
+#define SORT_TIME 1 /* newest first */
+#define SORT_SIZE 2 /* largest first */
+
+#define MAX_JOBS 256
+#define STAT_CHUNK 64 /* entries a stat worker claims at a time */
+#define PARALLEL_MIN 512 /* smaller directories are stat'ed serially */
+#define URING_DEPTH 512 /* statx requests a ring keeps in flight */
+#define STREAM_CHUNK 1024 /* entries printed at a time by unsorted listings */
+#define WALK_AHEAD_BYTES (64 * ONE_MB) /* listed roots waiting to be printed */
+#define ELISTED (-1) /* node_t err of a directory -R printed already */
+#define RENDER_CHUNK 16384 /* entries a rendering thread takes at a time */
+#define ID_BUFSIZE 1024 /* first getpwuid_r() buffer, grown on ERANGE */
+#define RUN_BUFSIZE (64 * ONE_KB) /* read buffer of each --max-memory run */
+#define MERGE_WAYS 64 /* most runs merged at once */
+#define MERGE_CHUNK (2 * RENDER_CHUNK) /* entries printed at a time by a merge */
+#define GLOB_MAX_TOKENS 63 /* longer globs are left to fnmatch() */
+#define GLOB_DFA_STATES 64 /* globs needing more run their NFA */
+
+#define GLOB_EXACT 0 /* a literal name */
+#define GLOB_AFFIX 1 /* literal prefix '*' literal suffix, either may be empty */
+#define GLOB_SUBSTR 2 /* '*' literal '*' */
+#define GLOB_DFA 3
+#define GLOB_NFA 4 /* bit-parallel, one bit per token */
+#define GLOB_FNMATCH 5 /* what glob_compile() doesn't parse */
+
 struct arg_t {
     int all; /* all files */
     int almost; /* almost all files except . and .. */
     int human; /* human readable for file size */
     int follow; /* follow symbolic link */
+    int jobs; /* number of threads, 0 until job_count() counts the cores */
+    int unsorted; /* list entries in directory order */
+    int shortfmt; /* names only, one per line */
+    int classify; /* append a file type indicator, see CLASSIFY_* */
+    int recursive; /* list subdirectories recursively */
+    int sortkey; /* see SORT_*, ignored when unsorted */
+    int reverse; /* reverse the sort order */
+    unsigned long head; /* print the first head entries of a listing, 0 for all */
+    int du; /* total up the disk usage of each directory's subtree */
+    int uring; /* stat through io_uring when the kernel supports it */
+    char *cache; /* directory of the --cache files, NULL for none */
+    int watch; /* keep listing the changes of the directory */
+    int format; /* see FMT_* */
+    int owner_names; /* --format records carry user and group names */
+    int stats; /* print the --stats counters at exit */
+    int numeric; /* uid and gid numbers instead of names, no NSS lookups */
+    int skip_seen; /* -R lists each directory once, however it is reached */
+    size_t max_memory; /* --max-memory budget of a sorted listing, 0 for none */
     char **files; /* file names */
     int fc; /* number of files */
 };
 
+/* record layout returned by the getdents64 syscall */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct ablock_t {
+    struct ablock_t *next;
+    size_t size, used; /* bytes of data following the header */
+};
+
+/*
+ * Bump allocator for the state of one directory listing. Nothing is freed
+ * on its own; arena_reset() makes all blocks reusable in O(1).
+ */
+struct arena_t {
+    struct ablock_t *first, *cur;
+    size_t next; /* size of the next block to allocate */
+    size_t max; /* blocks double up to this size */
+};
+
+/*
+ * Entries of one listing as a struct of arrays. Reading a directory fills
+ * in the names, d_ino and d_type, stat_range() the other fields. Sorting
+ * only permutes the 32-bit indices in order.
+ */
+struct table_t {
+    struct arena_t *arena; /* holds every array below */
+    int dirfd; /* names are resolved relative to it, -1 if closed */
+    uint32_t n, cap;
+    char *names; /* NUL terminated names back to back */
+    size_t pool_used, pool_size;
+    uint32_t *name; /* offset of each name in names */
+    uint16_t *len; /* its length, paths longer than that can't be opened */
+    unsigned char *type; /* DT_* file type, DT_UNKNOWN if not provided */
+    uint64_t *ino;
+    /* filled in by stat_range() */
+    uint32_t *nlink, *mode, *uid, *gid;
+    int64_t *size, *mtime, *blocks;
+    uint32_t *mtime_ns; /* nanoseconds of mtime */
+    uint64_t *dev; /* st_dev, only for --du's hard links */
+    int *err; /* errno of the stat call, 0 on success */
+    uint32_t *order; /* output order, NULL for table order */
+};
+
+/*
+ * --format=binary record, in host byte order. The name follows, then the
+ * link target, user and group name if any, without NUL bytes. len covers
+ * all of it and is a multiple of 8, so records can be read in place.
+ * A BIN_DIR record starts the entries of a directory whose path is in
+ * the name; its other fields are 0.
+ */
+struct bin_rec_t {
+    uint32_t len;
+    uint8_t kind; /* BIN_ENTRY or BIN_DIR */
+    uint8_t type; /* DT_* */
+    uint16_t name_len;
+    uint32_t target_len;
+    int32_t err; /* errno of stat, the fields below are 0 if set */
+    uint32_t mode, nlink, uid, gid;
+    uint32_t mtime_ns;
+    uint16_t user_len, group_len;
+    int64_t mtime;
+    uint64_t ino;
+    int64_t size, blocks;
+};
+
+#define BIN_ENTRY 0
+#define BIN_DIR 1
+
+#define CACHE_MAGIC "lscache3"
+#define CACHE_ARRAYS 5 /* table arrays in a cache file, names not counted */
+
+/*
+ * Header of a --cache file. The table_t arrays a -1 listing prints from
+ * follow it, each padded to 8 bytes, then the names. The file is only
+ * valid on the machine that wrote it.
+ */
+struct cache_hdr_t {
+    char magic[8];
+    uint32_t flags; /* options that change what the table holds */
+    uint32_t n;
+    uint64_t dev, ino; /* of the directory */
+    int64_t mtime, mtime_nsec, ctime, ctime_nsec;
+    uint64_t pool; /* bytes of names */
+};
+
+/* a range of a table to be stat'ed by one or more threads */
+struct stat_job_t {
+    struct table_t *t;
+    uint32_t from, to;
+    uint32_t nstat; /* number of entries that really need a stat call */
+    uint32_t next; /* first entry not claimed by a worker yet */
+};
+
+/*
+ * output is rendered here and handed to write() in big chunks, buffers
+ * with fd -1 grow instead and are written by their owner
+ */
+struct outbuf_t {
+    char *buf;
+    size_t len, size;
+    int fd;
+    int line_flush; /* flush after every line, for terminals */
+};
+
+/* column widths of long format lines, at least the historical ones */
+struct widths_t {
+    int ino, nlink, size;
+};
+
+/*
+ * --watch state: the table only grows, idx holds the entries still there
+ * in output order and names finds them by name.
+ */
+struct watch_t {
+    struct arena_t arena[2]; /* the table is in one, compacted into the other */
+    int cur;
+    struct table_t t;
+    uint32_t *idx, nidx, cap;
+    uint32_t *names; /* entry + 1, 0 for empty, WATCH_GONE for removed */
+    uint32_t nnames, size, used; /* live, slots and slots not empty */
+    uint32_t dead; /* table entries no longer in idx */
+    struct widths_t w;
+};
+
+#define WATCH_GONE UINT32_MAX
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+                      IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* uid/gid -> name, "" when the id has no name */
+struct idname_t {
+    unsigned int id;
+    int used;
+    char *name;
+};
+
+/* open addressing hash table of idname_t */
+struct idcache_t {
+    struct idname_t *slots;
+    unsigned int size, count; /* size is a power of two */
+};
+
+/*
+ * Timestamps in [lo, hi) share their date and UTC offset, so only the
+ * clock part has to be computed. base is the local time of day at lo.
+ */
+struct timecache_t {
+    time_t lo, hi;
+    long base;
+    time_t minute; /* start of the minute buf currently holds */
+    int have_minute;
+    size_t prefix; /* length of the "%F " part of buf */
+    char buf[64];
+};
+
+/*
+ * What rendering entries needs besides the table: the options, the
+ * output and the caches of one rendering thread. The fmt_* and pr_*
+ * functions only change what their context holds, and the id caches are
+ * only read once filled (idcache_fill()), so threads with a context each
+ * can render parts of a table at the same time.
+ */
+struct fmtctx_t {
+    const struct arg_t *opt;
+    struct outbuf_t *out;
+    struct widths_t *w;
+    struct timecache_t tc; /* empty window, the first fmt_time() misses */
+};
+
+/* a slice of a table rendered by a thread of print_range() */
+struct render_job_t {
+    struct fmtctx_t c;
+    struct outbuf_t out;
+    struct table_t *t;
+    uint32_t from, to;
+    uint32_t stop; /* entry that failed, to when none did */
+    const char *msg; /* and its err_sys() message */
+    int err;
+};
+
+/* case folded 8 byte name prefix, big endian so it compares like the name */
+struct skey_t {
+    uint64_t key;
+    uint32_t idx; /* index of the name being sorted */
+};
+
+/* a sorted --max-memory run in its temporary file */
+struct run_t {
+    int fd;
+    int level; /* times its entries were merged */
+    char *buf; /* RUN_BUFSIZE bytes while it is merged */
+    size_t pos, len;
+    struct bin_rec_t *rec; /* current record in buf, NULL at the end */
+};
+
+struct runs_t {
+    struct run_t *r; /* in reading order */
+    int n, cap;
+    int ways; /* runs merged at once */
+};
+
+/* a compiled --ignore or --include pattern, see glob_compile() */
+struct glob_t {
+    const char *pattern;
+    int kind; /* GLOB_* */
+    int lead_dot; /* starts with a literal '.', which FNM_PERIOD needs */
+    char *lit; /* the literal bytes, pre of them before the '*' */
+    size_t len, pre;
+    int ntok; /* tokens of the NFA, a run of '*' is one */
+    uint64_t b[256]; /* bit k is set if token k matches the byte */
+    uint64_t stars; /* bit k is set if token k is a '*' */
+    unsigned char *dfa; /* 256 next states for each state */
+    uint64_t accept[GLOB_DFA_STATES / 64];
+};
+
+struct filter_t {
+    struct glob_t *ignore, *include;
+    int nignore, ninclude;
+};
+
+/* a directory of a -R listing, filled in by a walker thread */
+struct node_t {
+    char *path; /* as printed in the header */
+    char *name; /* last component of path, opened relative to parent */
+    struct node_t *parent;
+    int refs; /* the printer plus one for each child */
+    int fd_users; /* the printer plus each child that is not open yet */
+    dev_t dev;
+    ino_t ino;
+    int err; /* errno when the directory can not be listed, or ELISTED */
+    const char *errmsg;
+    struct arena_t arena; /* everything below, freed once printed */
+    struct table_t tab; /* entries after skip(), fd of the directory */
+    struct node_t **kids; /* subdirectories in output order */
+    int nkids;
+    int done; /* all of the above is filled in */
+    int stale; /* below a directory --skip-seen skipped, the printer drops it */
+    /* --du */
+    int quiet; /* only walked for the totals, never printed */
+    int64_t slot; /* entry of the parent's table that gets our size, or -1 */
+    int du_pending; /* this node plus each child whose subtree isn't done */
+    uint64_t du_blocks, du_size; /* of the subtree, hard links once */
+    int du_done; /* du_pending dropped to 0 */
+    size_t ahead_bytes; /* what a root adds to walker_t.ahead_bytes */
+};
+
+#ifdef HAVE_IO_URING
+/* a thread's io_uring, set up by hand on the raw syscalls */
+struct uring_t {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    struct statx stx[URING_DEPTH]; /* result buffer of each request slot */
+    uint32_t entry[URING_DEPTH]; /* table entry of each slot */
+    uint32_t free[URING_DEPTH]; /* slots not in flight */
+};
+#endif
+
+#define ID_SHARDS 64 /* power of 2 */
+
+/*
+ * One shard of a set of (dev, ino) pairs, 16 bytes a slot. Sets are split
+ * into ID_SHARDS shards by hash so walkers seldom wait on each other's
+ * lock.
+ */
+struct idshard_t {
+    pthread_mutex_t lock;
+    uint64_t *keys; /* dev, ino pairs, ino 0 for an empty slot */
+    size_t n, cap;
+};
+
+/* nodes of one walker thread: it works at the tail, thieves take the head */
+struct deque_t {
+    pthread_mutex_t lock;
+    struct node_t **items; /* items[head..tail) */
+    int head, tail, cap;
+};
+
+/*
+ * Work stealing traversal for -R. Walker threads read and stat
+ * directories from their own deque and steal from the others when it runs
+ * dry, while the main thread prints the finished nodes depth first.
+ */
+struct walker_t {
+    struct deque_t *deques;
+    struct arena_t *scratch; /* per walker, reset after each directory */
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* idle walkers wait here for nodes */
+    pthread_cond_t done; /* the printer waits here for waiting */
+    int idle; /* walkers waiting on work */
+    int queued; /* nodes sitting in deques */
+    int pending; /* nodes pushed and not walked yet */
+    struct node_t *waiting;
+    /* the arguments, handed to the walkers by walk_feed() */
+    pthread_mutex_t feed_lock; /* for all of these */
+    struct node_t **roots;
+    int nroots, next;
+    int feeding; /* some are not handed out yet */
+    int ahead, ahead_done; /* handed out and not printed, of those walked */
+    size_t ahead_bytes; /* arenas of those walked */
+};
+
+struct walker_arg_t {
+    struct walker_t *w;
+    int id; /* index of the own deque */
+};
+
 static struct arg_t g_args; /* defaults to 0s */
-static const char *opts = "aAhL";
+static struct filter_t g_filter; /* --ignore and --include */
+static struct idcache_t g_users, g_groups; /* live for the whole process */
+static struct outbuf_t g_out = {NULL, 0, 0, STDOUT_FILENO, 0};
+static struct fmtctx_t g_fmt = {.opt = &g_args, .out = &g_out}; /* printer */
+static struct arena_t g_arena = {NULL, NULL, ARENA_BLOCK,
+                                 ARENA_MAX_BLOCK}; /* main thread */
+static struct idshard_t g_links[ID_SHARDS]; /* files with links --du counted */
+static struct idshard_t g_seen[ID_SHARDS]; /* directories -R --skip-seen listed */
+static __thread char *t_dents; /* getdents64 buffer of each reading thread */
+static __thread size_t t_dents_size;
+static int g_stat_threads; /* stat_range() helpers running, for all callers */
+#ifdef HAVE_IO_URING
+static __thread struct uring_t *t_ring; /* NULL until the first use */
+static __thread int t_no_ring; /* io_uring didn't work out, use stat_worker */
+#endif
+/*
+ * --stats counters. Every thread counts into its own t_stats and adds
+ * them to g_stats when it is done (stats_flush()), so a count is a plain
+ * increment and stays compiled in. The clocks are read under --stats
+ * only. Phases nest: a phase's time leaves out the phases it calls, so
+ * formatting doesn't include owner lookups, localtime() or the writes it
+ * triggers.
+ */
+enum { PH_READ, PH_STAT, PH_SORT, PH_OWNER, PH_TIME, PH_FORMAT, PH_WRITE,
+       PH_N };
+enum { SC_OPEN, SC_GETDENTS, SC_STAT, SC_READLINK, SC_URING, SC_INOTIFY,
+       SC_WRITE, SC_N };
+static const char *ph_names[PH_N] = {"read", "stat", "sort", "owner", "time",
+                                     "format", "write"};
+static const char *sc_names[SC_N] = {"open", "getdents64", "stat",
+                                     "readlink", "io_uring_enter",
+                                     "inotify read", "write"};
+
+struct stats_t {
+    uint64_t wall[PH_N], cpu[PH_N]; /* ns */
+    uint64_t nested_wall, nested_cpu; /* of the phases that ended so far */
+    uint64_t sys[SC_N];
+    uint64_t written; /* bytes */
+    uint64_t localtime; /* calls */
+    uint64_t id_hits[2], id_misses[2]; /* of g_users and g_groups */
+};
+
+/* a running phase */
+struct stimer_t {
+    uint64_t wall, cpu;
+    uint64_t nested_wall, nested_cpu; /* t_stats' at the start */
+};
+
+static __thread struct stats_t t_stats;
+static struct stats_t g_stats; /* of the threads that are done */
+static size_t g_arena_bytes, g_arena_peak; /* arena blocks of all threads */
+
+static uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_start(struct stimer_t *s) {
+    if (!g_args.stats) return;
+    s->wall = clock_ns(CLOCK_MONOTONIC);
+    s->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    s->nested_wall = t_stats.nested_wall;
+    s->nested_cpu = t_stats.nested_cpu;
+}
+
+static void stats_stop(struct stimer_t *s, int ph, int count_wall) {
+    uint64_t wall, cpu;
+
+    if (!g_args.stats) return;
+    wall = clock_ns(CLOCK_MONOTONIC) - s->wall;
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - s->cpu;
+    if (count_wall) {
+        t_stats.wall[ph] += wall - (t_stats.nested_wall - s->nested_wall);
+    }
+    t_stats.cpu[ph] += cpu - (t_stats.nested_cpu - s->nested_cpu);
+    t_stats.nested_wall = s->nested_wall + wall;
+    t_stats.nested_cpu = s->nested_cpu + cpu;
+}
+
+static void stats_end(struct stimer_t *s, int ph) {
+    stats_stop(s, ph, 1);
+}
+
+/*
+ * for helper threads of a phase, whose wall time is already the time of
+ * the thread waiting for them
+ */
+static void stats_end_cpu(struct stimer_t *s, int ph) {
+    stats_stop(s, ph, 0);
+}
+
+/* add the counts of this thread to g_stats */
+static void stats_flush(void) {
+    uint64_t *from = (uint64_t*)&t_stats, *to = (uint64_t*)&g_stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(t_stats) / sizeof(uint64_t); i++) {
+        if (from[i] != 0) __atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+    }
+    memset(&t_stats, 0, sizeof(t_stats));
+}
+
+static void stats_arena(ssize_t n) {
+    size_t now = __atomic_add_fetch(&g_arena_bytes, n, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&g_arena_peak, __ATOMIC_RELAXED);
+
+    while (now > peak && !__atomic_compare_exchange_n(&g_arena_peak, &peak,
+                now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+static const char *opts = "aAhLUf1FRtSrsn";
+enum {
+    OPT_JOBS = 256, /* long only options */
+    OPT_FILE_TYPE,
+    OPT_HEAD,
+    OPT_IO_URING,
+    OPT_CACHE,
+    OPT_WATCH,
+    OPT_FORMAT,
+    OPT_OWNER_NAMES,
+    OPT_STATS,
+    OPT_MAX_MEMORY,
+    OPT_SKIP_SEEN,
+    OPT_IGNORE,
+    OPT_INCLUDE
+};
 static const struct option options[] = {
     {"all", no_argument, NULL, 'a'},
     {"almost-all", no_argument, NULL, 'A'},
     {"human-readable", no_argument, NULL, 'h'},
     {"dereference", no_argument, NULL, 'L'},
+    {"unsorted", no_argument, NULL, 'U'},
+    {"classify", no_argument, NULL, 'F'},
+    {"recursive", no_argument, NULL, 'R'},
+    {"reverse", no_argument, NULL, 'r'},
+    {"du", no_argument, NULL, 's'},
+    {"numeric-uid-gid", no_argument, NULL, 'n'},
+    {"file-type", no_argument, NULL, OPT_FILE_TYPE},
+    {"head", required_argument, NULL, OPT_HEAD},
+    {"io-uring", no_argument, NULL, OPT_IO_URING},
+    {"cache", required_argument, NULL, OPT_CACHE},
+    {"watch", no_argument, NULL, OPT_WATCH},
+    {"format", required_argument, NULL, OPT_FORMAT},
+    {"owner-names", no_argument, NULL, OPT_OWNER_NAMES},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+    {"skip-seen", no_argument, NULL, OPT_SKIP_SEEN},
+    {"ignore", required_argument, NULL, OPT_IGNORE},
+    {"include", required_argument, NULL, OPT_INCLUDE},
+    {"jobs", required_argument, NULL, OPT_JOBS},
     {"help", no_argument, NULL, '?'},
     {0, 0, 0, 0}
 };
 
 static void usage() {
     fprintf(stdout,
-            "Usage: ls -[aAhL] [FILE]...\n"
+            "Usage: ls -[aAhLUf1FRtSrsn] [FILE]...\n"
             "List information about the FILEs (the current directory by default).\n"
-            "Sort entries alphabetically\n\n"
+            "Sort entries alphabetically unless -t, -S, -U or -f is given\n\n"
             "-a, --all               do not ignore entries starting with .\n"
             "-A, --almost-all        do not list implied . and ..\n"
+            "--ignore=GLOB           do not list entries matching GLOB\n"
+            "--include=GLOB          list only entries matching GLOB, both may be\n"
+            "                        repeated and ignore --cache; -R doesn't descend\n"
+            "                        into ignored directories and lists the others,\n"
+            "                        --du totals count all entries\n"
             "-h, --human-readable    print sizes in human readable format\n"
             "-L, --dereference       follow symbolic link when showing information\n"
+            "-U, --unsorted          list entries in directory order as they are read\n"
+            "-f                      same as -aU\n"
+            "-1                      list one name per line, without details\n"
+            "-F, --classify          append indicator (one of */=@|) to entries\n"
+            "--file-type             likewise, except do not append '*'\n"
+            "-R, --recursive         list subdirectories recursively\n"
+            "--skip-seen             with -R, list each directory once, also when bind\n"
+            "                        mounts or -L links lead to it again\n"
+            "-t                      sort by modification time, newest first\n"
+            "-S                      sort by file size, largest first\n"
+            "-r, --reverse           reverse order while sorting\n"
+            "--head=N                list only the first N entries of each listing\n"
+            "-s, --du                print the disk usage of each directory's subtree\n"
+            "                        and show subdirectory sizes as subtree totals\n"
+            "-n, --numeric-uid-gid   print user and group IDs instead of names\n"
+            "--jobs=N                stat and render large directories and walk -R trees\n"
+            "                        with N threads (defaults to the number of cores)\n"
+            "--io-uring              keep many stat requests in flight with io_uring instead\n"
+            "                        of stat threads, for high latency file systems\n"
+            "--cache=DIR             keep sorted listings in DIR and reuse them as long as\n"
+            "                        the directory's mtime and ctime don't change; only\n"
+            "                        -1 listings without -t, -S, -s, -F or --format\n"
+            "--watch                 list one directory, then a line per change to it:\n"
+            "                        '+' added, '-' removed, '~' changed\n"
+            "--format=FMT            print records for programs instead of lines, FMT is\n"
+            "                        ndjson (a JSON object per line) or binary\n"
+            "--owner-names           add user and group names to --format records\n"
+            "--stats                 print time per phase, syscall counts and memory use\n"
+            "                        on stderr at exit\n"
+            "--max-memory=SIZE       sort directories larger than SIZE (K, M or G) in runs\n"
+            "                        through temporary files in $TMPDIR\n"
             "--help                  show this message\n"
             );
 }
 
-static void err_sys(const char *fmt, ...) {
-    va_list ap;
-    char buf[MAXLINE];
+static void out_flush(struct outbuf_t *out) {
+    size_t off = 0;
+    ssize_t n;
+    struct stimer_t st;
+
+    stats_start(&st);
+    while (off < out->len) {
+        n = write(out->fd, out->buf + off, out->len - off);
+        t_stats.sys[SC_WRITE]++;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            out->len = 0;
+            fprintf(stderr, "ls: write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        off += n;
+    }
+    t_stats.written += out->len;
+    out->len = 0;
+    stats_end(&st, PH_WRITE);
+}
+
+/* make room for n more bytes and return where they go */
+static char* out_reserve(struct outbuf_t *out, size_t n) {
+    if (out->len + n > out->size && out->fd == -1) {
+        out->size = out->len + n > 2 * out->size ? out->len + n : 2 * out->size;
+        out->buf = realloc(out->buf, out->size);
+        if (out->buf == NULL) {
+            fprintf(stderr, "ls: no memory\n");
+            exit(1);
+        }
+    } else if (out->len + n > out->size) {
+        out_flush(out);
+        if (n > out->size) {
+            out->size = n > OUTBUF_SIZE ? n : OUTBUF_SIZE;
+            free(out->buf);
+            out->buf = malloc(out->size);
+            if (out->buf == NULL) {
+                fprintf(stderr, "ls: no memory\n");
+                exit(1);
+            }
+        }
+    }
+    return out->buf + out->len;
+}
+
+static void out_mem(struct outbuf_t *out, const char *s, size_t n) {
+    memcpy(out_reserve(out, n), s, n);
+    out->len += n;
+}
+
+static void out_str(struct outbuf_t *out, const char *s) {
+    out_mem(out, s, strlen(s));
+}
+
+static void out_char(struct outbuf_t *out, char c) {
+    *out_reserve(out, 1) = c;
+    out->len++;
+}
+
+static void out_pad(struct outbuf_t *out, int n) {
+    if (n > 0) {
+        memset(out_reserve(out, n), ' ', n);
+        out->len += n;
+    }
+}
+
+/* s padded with spaces on the right to width, like "%-*s" */
+static void out_str_left(struct outbuf_t *out, const char *s, int width) {
+    size_t n = strlen(s);
+    out_mem(out, s, n);
+    out_pad(out, width - (int)n);
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* decimal digits of v at the end of buf, returns the first one */
+static char* fmt_ulong(char *end, unsigned long v) {
+    while (v >= 100) {
+        end -= 2;
+        memcpy(end, &digit_pairs[v % 100 * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, &digit_pairs[v * 2], 2);
+    } else {
+        *--end = '0' + v;
+    }
+    return end;
+}
+
+/* v padded on the right to width, like "%-*lu" */
+static void out_num_left(struct outbuf_t *out, unsigned long v, int width) {
+    char buf[24], *p = fmt_ulong(buf + sizeof(buf), v);
+    int n = buf + sizeof(buf) - p;
+    out_mem(out, p, n);
+    out_pad(out, width - n);
+}
+
+/* v padded on the left to width, like "%*ld" */
+static void out_num_right(struct outbuf_t *out, long v, int width) {
+    char buf[24], *p = fmt_ulong(buf + sizeof(buf),
+                                 v < 0 ? -(unsigned long)v : (unsigned long)v);
+    int n;
+
+    if (v < 0) *--p = '-';
+    n = buf + sizeof(buf) - p;
+    out_pad(out, width - n);
+    out_mem(out, p, n);
+}
+
+/* end of an output line */
+static void out_eol(struct outbuf_t *out) {
+    out_char(out, '\n');
+    if (out->line_flush) {
+        out_flush(out);
+    }
+}
+
+static void err_sys(const char *fmt, ...) {
+    va_list ap;
+    char buf[MAXLINE];
+
+    va_start(ap, fmt);
+    vsnprintf(buf, MAXLINE, fmt, ap);
+    snprintf(buf+strlen(buf), MAXLINE-strlen(buf), ": %s", strerror(errno));
+    strcat(buf, "\n");
+    out_flush(&g_out); /* in case stdout and stderr are the same */
+    fputs(buf, stderr);
+    fflush(NULL);
+    va_end(ap);
+}
+
+/* err_sys() without errno, for errors no system call returned */
+static void err_msg(const char *fmt, ...) {
+    va_list ap;
+    char buf[MAXLINE];
+
+    va_start(ap, fmt);
+    vsnprintf(buf, MAXLINE - 1, fmt, ap);
+    strcat(buf, "\n");
+    out_flush(&g_out); /* in case stdout and stderr are the same */
+    fputs(buf, stderr);
+    fflush(NULL);
+    va_end(ap);
+}
+
+static void* xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        err_sys("ls: no memory");
+        exit(1);
+    }
+    return p;
+}
+
+#define ABLOCK_HDR ((sizeof(struct ablock_t) + 7) & ~(size_t)7)
+
+static void arena_init(struct arena_t *a, size_t first) {
+    a->first = a->cur = NULL;
+    a->next = first;
+    a->max = ARENA_MAX_BLOCK;
+}
+
+/* n bytes aligned to align (a power of two, at most 8) */
+static void* arena_take(struct arena_t *a, size_t n, size_t align) {
+    struct ablock_t *b = a->cur, *nb;
+    size_t off;
+
+    for (;;) {
+        if (b != NULL) {
+            off = (b->used + align - 1) & ~(align - 1);
+            if (off + n <= b->size) break;
+            if (b->next != NULL) { /* left over from before arena_reset() */
+                b = b->next;
+                b->used = 0;
+                continue;
+            }
+        }
+        nb = xrealloc(NULL, ABLOCK_HDR + (n > a->next ? n : a->next));
+        nb->size = n > a->next ? n : a->next;
+        stats_arena(ABLOCK_HDR + nb->size);
+        nb->used = 0;
+        nb->next = NULL;
+        if (b != NULL) {
+            b->next = nb;
+        } else {
+            a->first = nb;
+        }
+        if (a->next < a->max) {
+            a->next = 2 * a->next < a->max ? 2 * a->next : a->max;
+        }
+        b = nb;
+    }
+    a->cur = b;
+    b->used = off + n;
+    return (char*)b + ABLOCK_HDR + off;
+}
+
+static void* arena_alloc(struct arena_t *a, size_t n) {
+    return arena_take(a, n, 8);
+}
+
+static void arena_reset(struct arena_t *a) {
+    a->cur = a->first;
+    if (a->first != NULL) {
+        a->first->used = 0;
+    }
+}
+
+/*
+ * Allocate blocks of at most max bytes from now on, larger ones only for
+ * allocations that need them.
+ */
+static void arena_limit(struct arena_t *a, size_t max) {
+    a->max = max;
+    if (a->next > max) {
+        a->next = max;
+    }
+}
+
+/* bytes of the blocks of a */
+static size_t arena_size(struct arena_t *a) {
+    struct ablock_t *b;
+    size_t n = 0;
+
+    for (b = a->first; b != NULL; b = b->next) {
+        n += ABLOCK_HDR + b->size;
+    }
+    return n;
+}
+
+/* bytes of a in use, leaving out the blocks arena_reset() kept for reuse */
+static size_t arena_used(struct arena_t *a) {
+    struct ablock_t *b;
+    size_t n = 0;
+
+    for (b = a->first; b != NULL; b = b->next) {
+        n += ABLOCK_HDR + b->used;
+        if (b == a->cur) break;
+    }
+    return n;
+}
+
+static void arena_free(struct arena_t *a) {
+    struct ablock_t *b, *next;
+
+    for (b = a->first; b != NULL; b = next) {
+        next = b->next;
+        stats_arena(-(ssize_t)(ABLOCK_HDR + b->size));
+        free(b);
+    }
+    a->first = a->cur = NULL;
+}
+
+/* fold the first 8 bytes of s into a key, NUL padded */
+static uint64_t fold_key(const char *s) {
+    uint64_t key = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*s != '\0') {
+            key |= (unsigned char)tolower((unsigned char)*s++);
+        }
+    }
+    return key;
+}
+
+/* stable LSD radix sort of k by key, passes over constant bytes skipped */
+static void radix_sort(struct skey_t *k, struct skey_t *tmp, int n) {
+    uint32_t count[8][256];
+    struct skey_t *src = k, *dst = tmp, *t;
+    int i, b;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < 8; b++) {
+            count[b][(k[i].key >> (b * 8)) & 0xff]++;
+        }
+    }
+    for (b = 0; b < 8; b++) {
+        uint32_t sum = 0, c;
+        int shift = b * 8, x;
+
+        if (count[b][(k[0].key >> shift) & 0xff] == (uint32_t)n) {
+            continue;
+        }
+        for (x = 0; x < 256; x++) {
+            c = count[b][x];
+            count[b][x] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; i++) {
+            dst[count[b][(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+        t = src, src = dst, dst = t;
+    }
+    if (src != k) {
+        memcpy(k, src, sizeof(struct skey_t) * n);
+    }
+}
+
+static char* tname(struct table_t *t, uint32_t i) {
+    return t->names + t->name[i];
+}
+
+/* strcasecmp() order, ties keep their input order */
+static int name_cmp(struct table_t *t, struct skey_t *a, struct skey_t *b,
+                    size_t depth) {
+    int r = strcasecmp(tname(t, a->idx) + depth, tname(t, b->idx) + depth);
+    if (r != 0) return r;
+    return a->idx < b->idx ? -1 : a->idx > b->idx;
+}
+
+/*
+ * Multikey sort of k by the names from depth on: radix sort the 8 byte
+ * keys, then refine runs of equal keys with the next 8 bytes. A run whose
+ * key ends in NUL holds names that are equal ignoring case.
+ */
+static void key_sort(struct table_t *t, struct skey_t *k, struct skey_t *tmp,
+                     int n, size_t depth) {
+    int i, j;
+
+    if (n < KEY_SORT_MIN) {
+        for (i = 1; i < n; i++) {
+            struct skey_t cur = k[i];
+            for (j = i; j > 0 && name_cmp(t, &k[j-1], &cur, depth) > 0; j--) {
+                k[j] = k[j-1];
+            }
+            k[j] = cur;
+        }
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        k[i].key = fold_key(tname(t, k[i].idx) + depth);
+    }
+    radix_sort(k, tmp, n);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && k[j].key == k[i].key; j++)
+            ;
+        if (j - i > 1 && (k[i].key & 0xff) != 0) {
+            key_sort(t, k + i, tmp, j - i, depth + 8);
+        }
+    }
+}
+
+/*
+ * The -t and -S sort key of entry i, larger values sort first. Entries
+ * that failed to stat sort as the oldest and smallest.
+ */
+static uint64_t sort_key(struct table_t *t, uint32_t i) {
+    if (t->err[i] != 0) return 0;
+    if (g_args.sortkey == SORT_TIME) {
+        return (uint64_t)t->mtime[i] ^ (1ULL << 63); /* signed to unsigned */
+    }
+    return (uint64_t)t->size[i];
+}
+
+/*
+ * Put the entries of t in the order of g_args.sortkey and g_args.reverse
+ * by filling in t->order. Names are ordered ignoring case, as
+ * strcasecmp() orders them; -t and -S then run a stable radix sort on the
+ * inverted key over that order, so equal keys stay in name order. The
+ * keys are allocated from scratch, -t and -S need t stat'ed first.
+ */
+static void sort(struct table_t *t, struct arena_t *scratch) {
+    struct skey_t *k, *tmp;
+    uint32_t i;
+    struct stimer_t st;
+
+    stats_start(&st);
+    t->order = arena_alloc(t->arena, sizeof(uint32_t) * t->n);
+    if (t->n < 2) {
+        if (t->n == 1) t->order[0] = 0;
+        stats_end(&st, PH_SORT);
+        return;
+    }
+    k = arena_alloc(scratch, sizeof(struct skey_t) * t->n);
+    tmp = arena_alloc(scratch, sizeof(struct skey_t) * t->n);
+    for (i = 0; i < t->n; i++) {
+        k[i].idx = i;
+    }
+    key_sort(t, k, tmp, t->n, 0);
+    if (g_args.sortkey != SORT_NAME) {
+        for (i = 0; i < t->n; i++) {
+            k[i].key = ~sort_key(t, k[i].idx);
+        }
+        radix_sort(k, tmp, t->n);
+    }
+    for (i = 0; i < t->n; i++) {
+        t->order[g_args.reverse ? t->n - 1 - i : i] = k[i].idx;
+    }
+    stats_end(&st, PH_SORT);
+}
+
+/*
+ * The set of bytes the bracket expression at p matches, with p moved past
+ * it. Returns -1 where fnmatch() is left to decide: unterminated brackets,
+ * collating elements, unknown classes and odd ranges.
+ */
+static int glob_bracket(const unsigned char **pp, uint64_t set[4]) {
+    static const char *names[] = {"alnum", "alpha", "blank", "cntrl",
+        "digit", "graph", "lower", "print", "punct", "space", "upper",
+        "xdigit"};
+    static int (*const is[])(int) = {isalnum, isalpha, isblank, iscntrl,
+        isdigit, isgraph, islower, isprint, ispunct, isspace, isupper,
+        isxdigit};
+    const unsigned char *q = *pp + 1;
+    int c, lo, hi, j, first = 1, neg;
+    size_t len;
+
+    neg = *q == '!' || *q == '^';
+    q += neg;
+    for (; *q != ']' || first; first = 0) {
+        if (*q == '\0') return -1;
+        if (q[0] == '[' && (q[1] == '.' || q[1] == '=')) return -1;
+        if (q[0] == '[' && q[1] == ':') {
+            for (j = 0; j < 12; j++) {
+                len = strlen(names[j]);
+                if (strncmp((const char*)q + 2, names[j], len) == 0 &&
+                    q[2+len] == ':' && q[3+len] == ']') break;
+            }
+            if (j == 12) return -1;
+            for (c = 0; c < 256; c++) {
+                if (is[j](c)) set[c >> 6] |= 1ULL << (c & 63);
+            }
+            q += len + 4;
+            continue;
+        }
+        if (*q == '\\' && q[1] != '\0') q++;
+        lo = hi = *q++;
+        if (q[0] == '-' && q[1] != ']' && q[1] != '\0') {
+            if (q[1] == '\\' || q[1] == '[' || q[1] < lo) return -1;
+            hi = q[1];
+            q += 2;
+        }
+        for (c = lo; c <= hi; c++) {
+            set[c >> 6] |= 1ULL << (c & 63);
+        }
+    }
+    for (j = 0; neg && j < 4; j++) {
+        set[j] = ~set[j];
+    }
+    *pp = q + 1;
+    return 0;
+}
+
+/*
+ * Subset construction over the NFA of g, GLOB_DFA_STATES states at most.
+ * State 0 is dead, state 1 the start. Returns -1 if it gets bigger.
+ */
+static int glob_dfa(struct glob_t *g) {
+    uint64_t masks[GLOB_DFA_STATES], d;
+    int s, c, j, n = 2;
+
+    g->dfa = xrealloc(NULL, GLOB_DFA_STATES * 256);
+    masks[0] = 0;
+    masks[1] = 1 | ((g->stars & 1) << 1);
+    for (s = 1; s < n; s++) {
+        for (c = 0; c < 256; c++) {
+            d = ((masks[s] & g->b[c]) << 1) | (masks[s] & g->stars);
+            d |= (d & g->stars) << 1;
+            for (j = 0; j < n && masks[j] != d; j++)
+                ;
+            if (j == GLOB_DFA_STATES) {
+                free(g->dfa);
+                g->dfa = NULL;
+                return -1;
+            }
+            if (j == n) {
+                masks[n++] = d;
+            }
+            g->dfa[s * 256 + c] = j;
+        }
+    }
+    for (s = 0; s < n; s++) {
+        if (masks[s] >> g->ntok & 1) g->accept[s >> 6] |= 1ULL << (s & 63);
+    }
+    return 0;
+}
+
+/*
+ * Compile pattern into g. Literal patterns with at most a leading and a
+ * trailing '*' or a single '*' inside compare bytes; the others run a DFA
+ * over their bit-parallel NFA, or the NFA itself when the DFA would get
+ * too big. Either way names match as fnmatch(FNM_PERIOD) matches them in
+ * the C locale, and what the compiler doesn't take is left to fnmatch().
+ */
+static void glob_compile(struct glob_t *g, const char *pattern) {
+    const unsigned char *p = (const unsigned char*)pattern;
+    int lit[GLOB_MAX_TOKENS]; /* the byte of each token, -1 if not one */
+    uint64_t set[4];
+    int c, n, i, nstar = 0, star = -1, literal = 1;
+
+    memset(g, 0, sizeof(*g));
+    g->pattern = pattern;
+    for (n = 0; *p != '\0'; n++) {
+        if (n == GLOB_MAX_TOKENS) {
+            g->kind = GLOB_FNMATCH;
+            return;
+        }
+        lit[n] = -1;
+        if (*p == '*') {
+            while (*p == '*') p++;
+            g->stars |= 1ULL << n;
+            star = n;
+            nstar++;
+            continue;
+        }
+        memset(set, 0, sizeof(set));
+        if (*p == '?') {
+            memset(set, 0xff, sizeof(set));
+            p++;
+        } else if (*p == '[' && glob_bracket(&p, set) == 0) {
+            /* p is past it */
+        } else if (*p == '[') {
+            g->kind = GLOB_FNMATCH;
+            return;
+        } else if (*p == '\\' && p[1] == '\0') {
+            g->kind = GLOB_FNMATCH; /* matches nothing */
+            return;
+        } else {
+            if (*p == '\\') p++;
+            lit[n] = *p++;
+            set[lit[n] >> 6] |= 1ULL << (lit[n] & 63);
+        }
+        literal &= lit[n] != -1;
+        for (c = 0; c < 256; c++) {
+            if (set[c >> 6] >> (c & 63) & 1) g->b[c] |= 1ULL << n;
+        }
+    }
+    g->ntok = n;
+    g->lead_dot = n > 0 && lit[0] == '.';
+
+    g->lit = xrealloc(NULL, n + 1);
+    for (i = 0; i < n; i++) {
+        if (lit[i] != -1) g->lit[g->len++] = lit[i];
+    }
+    g->pre = g->len;
+    if (literal && nstar == 0) {
+        g->kind = GLOB_EXACT;
+    } else if (literal && nstar == 1) {
+        g->kind = GLOB_AFFIX;
+        g->pre = star;
+    } else if (literal && nstar == 2 && (g->stars & 1) && star == n - 1) {
+        g->kind = GLOB_SUBSTR;
+    } else {
+        g->kind = glob_dfa(g) == 0 ? GLOB_DFA : GLOB_NFA;
+    }
+}
+
+/* whether name, len bytes long, matches g */
+static int glob_match(const struct glob_t *g, const char *name, size_t len) {
+    const unsigned char *s = (const unsigned char*)name;
+    size_t suf = g->len - g->pre, i;
+    uint64_t d;
+    int st;
+
+    if (g->kind == GLOB_FNMATCH) {
+        return fnmatch(g->pattern, name, FNM_PERIOD) == 0;
+    }
+    if (s[0] == '.' && !g->lead_dot) {
+        return 0; /* FNM_PERIOD */
+    }
+    switch (g->kind) {
+        case GLOB_EXACT:
+            return len == g->len && memcmp(name, g->lit, len) == 0;
+        case GLOB_AFFIX:
+            return len >= g->len && memcmp(name, g->lit, g->pre) == 0 &&
+                   memcmp(name + len - suf, g->lit + g->pre, suf) == 0;
+        case GLOB_SUBSTR:
+            return memmem(name, len, g->lit, g->len) != NULL;
+        case GLOB_DFA:
+            for (i = 0, st = 1; i < len && st != 0; i++) {
+                st = g->dfa[st * 256 + s[i]];
+            }
+            return g->accept[st >> 6] >> (st & 63) & 1;
+    }
+    d = 1 | ((g->stars & 1) << 1);
+    for (i = 0; i < len && d != 0; i++) {
+        d = ((d & g->b[s[i]]) << 1) | (d & g->stars);
+        d |= (d & g->stars) << 1;
+    }
+    return d >> g->ntok & 1;
+}
+
+/*
+ * Whether --ignore or --include drops the entry name of DT_* type.
+ * Applied as the entries are read where --du doesn't need them, so
+ * dropped ones cost no stat or table space. -R still lists and walks the
+ * directories --include doesn't match; DT_UNKNOWN, and links under -L,
+ * may be directories until stat says otherwise.
+ */
+static int name_filtered(const char *name, size_t len, unsigned char type) {
+    int i;
+
+    for (i = 0; i < g_filter.nignore; i++) {
+        if (glob_match(&g_filter.ignore[i], name, len)) return 1;
+    }
+    for (i = 0; i < g_filter.ninclude; i++) {
+        if (glob_match(&g_filter.include[i], name, len)) return 0;
+    }
+    if (g_args.recursive && (type == DT_DIR || type == DT_UNKNOWN ||
+                             (g_args.follow && type == DT_LNK))) {
+        return 0;
+    }
+    return g_filter.ninclude > 0;
+}
+
+/*
+ * g_args.jobs, looked up on first use: counting the cores reads sysfs,
+ * which a listing that never goes parallel doesn't need. Called before
+ * any thread starts.
+ */
+static int job_count(void) {
+    long n;
+
+    if (g_args.jobs == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        g_args.jobs = n < 1 ? 1 : n > MAX_JOBS ? MAX_JOBS : (int)n;
+    }
+    return g_args.jobs;
+}
+
+static int parse_args(int argc, char **argv) {
+    int opt, index;
+    char *end;
+    static char* DEFAULT_FILES[] = {"."};
+
+    for (;;) {
+        opt = getopt_long(argc, argv, opts, options, &index);
+        if (opt == -1) break;
+        switch (opt) {
+            case 'a':
+                g_args.all = 1;
+                break;
+            case 'A':
+                g_args.almost = 1;
+                break;
+            case 'h':
+                g_args.human = 1;
+                break;
+            case 'L':
+                g_args.follow = 1;
+                break;
+            case 'U':
+                g_args.unsorted = 1;
+                break;
+            case 'f':
+                g_args.all = 1;
+                g_args.unsorted = 1;
+                break;
+            case '1':
+                g_args.shortfmt = 1;
+                break;
+            case 'F':
+                g_args.classify = CLASSIFY_EXEC;
+                break;
+            case 'R':
+                g_args.recursive = 1;
+                break;
+            case 't':
+                g_args.sortkey = SORT_TIME;
+                break;
+            case 'S':
+                g_args.sortkey = SORT_SIZE;
+                break;
+            case 'r':
+                g_args.reverse = 1;
+                break;
+            case 's':
+                g_args.du = 1;
+                break;
+            case 'n':
+                g_args.numeric = 1;
+                break;
+            case OPT_FILE_TYPE:
+                g_args.classify = CLASSIFY_TYPE;
+                break;
+            case OPT_HEAD:
+                g_args.head = strtoul(optarg, &end, 10);
+                if (*end != '\0' || g_args.head < 1 || g_args.head > UINT32_MAX ||
+                    !isdigit((unsigned char)*optarg)) {
+                    fprintf(stderr, "ls: invalid number of entries: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "ndjson") == 0) {
+                    g_args.format = FMT_NDJSON;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    g_args.format = FMT_BINARY;
+                } else if (strcmp(optarg, "text") == 0) {
+                    g_args.format = FMT_TEXT;
+                } else {
+                    fprintf(stderr, "ls: invalid format: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_OWNER_NAMES:
+                g_args.owner_names = 1;
+                break;
+            case OPT_STATS:
+                g_args.stats = 1;
+                break;
+            case OPT_SKIP_SEEN:
+                g_args.skip_seen = 1;
+                break;
+            case OPT_IGNORE:
+                g_filter.ignore = xrealloc(g_filter.ignore,
+                    sizeof(struct glob_t) * (g_filter.nignore + 1));
+                glob_compile(&g_filter.ignore[g_filter.nignore++], optarg);
+                break;
+            case OPT_INCLUDE:
+                g_filter.include = xrealloc(g_filter.include,
+                    sizeof(struct glob_t) * (g_filter.ninclude + 1));
+                glob_compile(&g_filter.include[g_filter.ninclude++], optarg);
+                break;
+            case OPT_MAX_MEMORY:
+                g_args.max_memory = strtoul(optarg, &end, 10);
+                if (*end == 'K' || *end == 'k') {
+                    g_args.max_memory *= ONE_KB, end++;
+                } else if (*end == 'M' || *end == 'm') {
+                    g_args.max_memory *= ONE_MB, end++;
+                } else if (*end == 'G' || *end == 'g') {
+                    g_args.max_memory *= (size_t)ONE_GB, end++;
+                }
+                if (*end != '\0' || g_args.max_memory == 0 ||
+                    !isdigit((unsigned char)*optarg)) {
+                    fprintf(stderr, "ls: invalid memory size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_WATCH:
+                g_args.watch = 1;
+                break;
+            case OPT_CACHE:
+                g_args.cache = optarg;
+                break;
+            case OPT_IO_URING:
+                g_args.uring = 1;
+                break;
+            case OPT_JOBS:
+                g_args.jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || g_args.jobs < 1 || g_args.jobs > MAX_JOBS) {
+                    fprintf(stderr, "ls: invalid number of jobs: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case '?':
+            default:
+                return -1;
+        }
+    }
+    
+    /* only one of two */
+    if (g_args.almost && g_args.all) {
+        g_args.almost = 0;
+    }
+    if (g_args.numeric) {
+        g_args.owner_names = 0;
+    }
+    if (!g_args.recursive) {
+        g_args.skip_seen = 0;
+    }
+    if (g_filter.nignore + g_filter.ninclude > 0) {
+        g_args.cache = NULL; /* cache files don't know about the patterns */
+    }
+
+    g_args.files = argv + optind;
+    g_args.fc = argc - optind;
+    if (g_args.fc == 0) {
+        g_args.files = DEFAULT_FILES;
+        g_args.fc = 1;
+    }
+
+    return 0;
+}
+
+#ifdef DEBUG
+static void dump_opts(void) {
+    int i;
+    fprintf(stdout, "--dumping options--\n");
+    if (g_args.all) {
+        fprintf(stdout, "--all ");
+    }
+    if (g_args.almost) {
+        fprintf(stdout, "--almost-all ");
+    }
+    if (g_args.human) {
+        fprintf(stdout, "--human-readable ");
+    }
+    if (g_args.follow) {
+        fprintf(stdout, "--dereference");
+    }
+    fprintf(stdout, "\nfiles to process:\n");
+
+    for (i = 0; i < g_args.fc; i++) {
+        fprintf(stdout, "%s\n", g_args.files[i]);
+    }
+    fprintf(stdout, "--end options--\n");
+}
+#endif
+
+static int isdir(const char *path) {
+    struct stat buf;
+    int ret = stat(path, &buf);
+    t_stats.sys[SC_STAT]++;
+    return ret == 0 && S_ISDIR(buf.st_mode);
+}
+
+static void table_init(struct table_t *t, struct arena_t *a, int dirfd) {
+    memset(t, 0, sizeof(*t));
+    t->arena = a;
+    t->dirfd = dirfd;
+}
+
+/* make room for one more entry and len more bytes of names */
+static void table_grow(struct table_t *t, size_t len) {
+    uint32_t cap = t->cap;
+    void *old;
+
+    if (t->n >= cap) {
+        t->cap = cap ? cap * 2 : 64;
+#define GROW(field, size) \
+        old = t->field; \
+        t->field = arena_take(t->arena, (size) * t->cap, size); \
+        if (t->n > 0) memcpy(t->field, old, (size) * t->n);
+        GROW(name, sizeof(uint32_t))
+        GROW(len, sizeof(uint16_t))
+        GROW(type, 1)
+        GROW(ino, sizeof(uint64_t))
+        if (t->err != NULL) {
+            GROW(nlink, sizeof(uint32_t))
+            GROW(mode, sizeof(uint32_t))
+            GROW(uid, sizeof(uint32_t))
+            GROW(gid, sizeof(uint32_t))
+            GROW(size, sizeof(int64_t))
+            GROW(mtime, sizeof(int64_t))
+            GROW(blocks, sizeof(int64_t))
+            GROW(mtime_ns, sizeof(uint32_t))
+            GROW(err, sizeof(int))
+        }
+        if (t->dev != NULL) {
+            GROW(dev, sizeof(uint64_t))
+        }
+#undef GROW
+    }
+    if (t->pool_used + len > t->pool_size) {
+        old = t->names;
+        while (t->pool_used + len > t->pool_size) {
+            t->pool_size = t->pool_size ? t->pool_size * 2 : 4 * ONE_KB;
+        }
+        t->names = arena_take(t->arena, t->pool_size, 1);
+        if (t->pool_used > 0) memcpy(t->names, old, t->pool_used);
+    }
+}
+
+static void table_add(struct table_t *t, const char *name, size_t len,
+                      unsigned char type, uint64_t ino) {
+    table_grow(t, len + 1);
+    t->name[t->n] = t->pool_used;
+    t->len[t->n] = len;
+    t->type[t->n] = type;
+    t->ino[t->n] = ino;
+    memcpy(t->names + t->pool_used, name, len + 1);
+    t->pool_used += len + 1;
+    t->n++;
+}
+
+/* the command line arguments, split into plain files and directories */
+static void classify(struct table_t *dirs, struct table_t *files) {
+    int i;
+
+    for (i = 0; i < g_args.fc; i++) {
+        char *name = g_args.files[i];
+        table_add(isdir(name) ? dirs : files, name, strlen(name),
+                  DT_UNKNOWN, 0);
+    }
+}
+
+/* only the fields pr_line() needs */
+#define STATX_LS_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | \
+                       STATX_GID | STATX_INO | STATX_SIZE | STATX_MTIME | \
+                       STATX_BLOCKS)
+
+static void set_statx(struct table_t *t, uint32_t i, struct statx *stx) {
+    t->ino[i] = stx->stx_ino;
+    t->nlink[i] = stx->stx_nlink;
+    t->mode[i] = stx->stx_mode;
+    t->uid[i] = stx->stx_uid;
+    t->gid[i] = stx->stx_gid;
+    t->size[i] = stx->stx_size;
+    t->mtime[i] = stx->stx_mtime.tv_sec;
+    t->mtime_ns[i] = stx->stx_mtime.tv_nsec;
+    t->blocks[i] = stx->stx_blocks;
+    if (t->dev != NULL) {
+        t->dev[i] = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    }
+}
+
+/* stat entry i of t into its arrays, -1 and errno on error */
+static int get_stat(struct table_t *t, uint32_t i) {
+    static int no_statx; /* shared by the stat workers, set at most once */
+    int flags = g_args.follow ? 0 : AT_SYMLINK_NOFOLLOW;
+    struct statx stx;
+    struct stat st;
+
+    t_stats.sys[SC_STAT]++;
+    if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)) {
+        if (statx(t->dirfd, tname(t, i), flags | AT_STATX_DONT_SYNC,
+                  STATX_LS_MASK, &stx) == 0) {
+            set_statx(t, i, &stx);
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        /* old kernel, use fstatat from now on */
+        __atomic_store_n(&no_statx, 1, __ATOMIC_RELAXED);
+        t_stats.sys[SC_STAT]++;
+    }
+    if (fstatat(t->dirfd, tname(t, i), &st, flags) != 0) {
+        return -1;
+    }
+    t->ino[i] = st.st_ino;
+    t->nlink[i] = st.st_nlink;
+    t->mode[i] = st.st_mode;
+    t->uid[i] = st.st_uid;
+    t->gid[i] = st.st_gid;
+    t->size[i] = st.st_size;
+    t->mtime[i] = st.st_mtime;
+    t->mtime_ns[i] = st.st_mtim.tv_nsec;
+    t->blocks[i] = st.st_blocks;
+    if (t->dev != NULL) {
+        t->dev[i] = st.st_dev;
+    }
+    return 0;
+}
+
+static void fmt_mode(struct outbuf_t *out, mode_t mode) {
+    char *ms = out_reserve(out, 10);
+    enum {
+        TYPE,
+        UR, UW, UX,
+        GR, GW, GX,
+        OR, OW, OX
+    };
+
+    memcpy(ms, DEFAULT_PERM, 10);
+    if (S_ISDIR(mode))  ms[TYPE] = 'd';
+    else if (S_ISLNK(mode))  ms[TYPE] = 'l';
+    else if (S_ISCHR(mode)) ms[TYPE] = 'c';
+    else if (S_ISBLK(mode)) ms[TYPE] = 'b';
+    else if (S_ISFIFO(mode)) ms[TYPE] = 'p';
+    else if (S_ISSOCK(mode)) ms[TYPE] = 's';
+
+    if ((S_IRUSR & mode) == S_IRUSR) ms[UR] = 'r';
+    if ((S_IWUSR & mode) == S_IWUSR) ms[UW] = 'w';
+    if ((S_IXUSR & mode) == S_IXUSR) ms[UX] = 'x';
+    if ((S_IRGRP & mode) == S_IRGRP) ms[GR] = 'r';
+    if ((S_IWGRP & mode) == S_IWGRP) ms[GW] = 'w';
+    if ((S_IXGRP & mode) == S_IXGRP) ms[GX] = 'x';
+    if ((S_IROTH & mode) == S_IROTH) ms[OR] = 'r';
+    if ((S_IWOTH & mode) == S_IWOTH) ms[OW] = 'w';
+    if ((S_IXOTH & mode) == S_IXOTH) ms[OX] = 'x';
+    out->len += 10;
+}
+
+static struct idname_t* idcache_slot(struct idcache_t *c, unsigned int id) {
+    unsigned int i = (id * 2654435761u) & (c->size - 1);
+
+    while (c->slots[i].used && c->slots[i].id != id) {
+        i = (i + 1) & (c->size - 1);
+    }
+    return &c->slots[i];
+}
+
+static void idcache_grow(struct idcache_t *c) {
+    struct idname_t *old = c->slots;
+    unsigned int i, size = c->size;
+
+    c->size = size ? size * 2 : 64;
+    c->slots = calloc(c->size, sizeof(struct idname_t));
+    if (c->slots == NULL) {
+        err_sys("ls: no memory");
+        exit(1);
+    }
+    for (i = 0; i < size; i++) {
+        if (old[i].used) {
+            *idcache_slot(c, old[i].id) = old[i];
+        }
+    }
+    free(old);
+}
+
+/*
+ * Look id up in c, calling lookup() only the first time an id is seen.
+ * Ids without a name are remembered too, so they cost one NSS call. Ids
+ * already in c are found without changing it.
+ */
+static char* idcache_get(struct idcache_t *c, unsigned int id,
+                         char* (*lookup)(unsigned int, char*, size_t)) {
+    struct idname_t *slot = c->size ? idcache_slot(c, id) : NULL;
+    struct stimer_t st;
+    char stack[ID_BUFSIZE], *buf = stack, *name;
+    size_t size = sizeof(stack);
+
+    if (slot != NULL && slot->used) {
+        t_stats.id_hits[c == &g_groups]++;
+        return slot->name;
+    }
+    t_stats.id_misses[c == &g_groups]++;
+    if (c->size == 0 || (c->count + 1) * 2 > c->size) {
+        idcache_grow(c);
+        slot = idcache_slot(c, id);
+    }
+    stats_start(&st);
+    while ((name = lookup(id, buf, size)) == NULL && errno == ERANGE) {
+        size *= 2;
+        buf = xrealloc(buf == stack ? NULL : buf, size);
+    }
+    stats_end(&st, PH_OWNER);
+    slot->name = (name == NULL) ? "" : strdup(name);
+    if (buf != stack) free(buf);
+    if (slot->name == NULL) {
+        err_sys("ls: no memory");
+        exit(1);
+    }
+    slot->id = id;
+    slot->used = 1;
+    c->count++;
+    return slot->name;
+}
+
+/* name of uid with buf as getpwuid_r() scratch, NULL and errno if none */
+static char* lookup_owner(unsigned int uid, char *buf, size_t size) {
+    struct passwd pwd, *res;
+    int err = getpwuid_r(uid, &pwd, buf, size, &res);
+
+    errno = err;
+    return (err != 0 || res == NULL) ? NULL : pwd.pw_name;
+}
+
+static char* lookup_group(unsigned int gid, char *buf, size_t size) {
+    struct group grp, *res;
+    int err = getgrgid_r(gid, &grp, buf, size, &res);
+
+    errno = err;
+    return (err != 0 || res == NULL) ? NULL : grp.gr_name;
+}
+
+static char* fmt_owner(uid_t uid) {
+    return idcache_get(&g_users, uid, lookup_owner);
+}
+
+static char* fmt_group(gid_t gid) {
+    return idcache_get(&g_groups, gid, lookup_group);
+}
+
+/*
+ * Look up the owners of entries [from, to) of t in output order, so that
+ * rendering them only reads g_users and g_groups.
+ */
+static void idcache_fill(struct table_t *t, uint32_t from, uint32_t to) {
+    uint32_t k, i;
+
+    for (k = from; k < to; k++) {
+        i = t->order ? t->order[k] : k;
+        if (t->err[i] == 0) {
+            fmt_owner(t->uid[i]);
+            fmt_group(t->gid[i]);
+        }
+    }
+}
+
+static int same_day(struct tm *a, struct tm *b) {
+    return a->tm_mday == b->tm_mday && a->tm_mon == b->tm_mon &&
+           a->tm_year == b->tm_year && a->tm_gmtoff == b->tm_gmtoff;
+}
+
+static int g_utc; /* TZ names UTC, times are converted by gmtime_r() */
+
+/*
+ * Set up time conversion once. tzset() parses TZ and loads the zone file;
+ * when TZ names UTC the offset is fixed and neither is needed.
+ */
+static void tz_init(void) {
+    static const char *utc[] = {"", "UTC", "UTC0", ":UTC", "Etc/UTC",
+                                ":Etc/UTC", "GMT", "GMT0", ":GMT", NULL};
+    const char *tz = getenv("TZ");
+    int i;
+
+    for (i = 0; tz != NULL && utc[i] != NULL; i++) {
+        if (strcmp(tz, utc[i]) == 0) {
+            g_utc = 1;
+            return;
+        }
+    }
+    tzset();
+}
+
+static struct tm* count_localtime(const time_t *t, struct tm *tm) {
+    t_stats.localtime++;
+    return g_utc ? gmtime_r(t, tm) : localtime_r(t, tm);
+}
+
+/*
+ * Full conversion of t. The cache window becomes the whole local day
+ * when the offset does not change during it, otherwise (DST switch) just
+ * the minute of t. In UTC it always is the whole day.
+ */
+static int time_miss(struct timecache_t *tc, time_t t) {
+    struct tm tm, edge;
+    struct stimer_t st;
+    long sod;
+
+    stats_start(&st);
+    if (count_localtime(&t, &tm) == NULL) {
+        stats_end(&st, PH_TIME);
+        return -1;
+    }
+    sod = tm.tm_hour * 3600L + tm.tm_min * 60 + tm.tm_sec;
+    tc->lo = t - sod;
+    tc->hi = tc->lo + 24 * 3600;
+    tc->base = 0;
+    if (!g_utc && (count_localtime(&tc->lo, &edge) == NULL ||
+        !same_day(&tm, &edge) ||
+        edge.tm_hour != 0 || edge.tm_min != 0 || edge.tm_sec != 0 ||
+        count_localtime(&(time_t){tc->hi - 1}, &edge) == NULL ||
+        !same_day(&tm, &edge) || edge.tm_hour != 23 ||
+        edge.tm_min != 59 || edge.tm_sec != 59)) {
+        tc->lo = t - tm.tm_sec;
+        tc->hi = tc->lo + 60;
+        tc->base = sod - tm.tm_sec;
+    }
+    tc->prefix = strftime(tc->buf, sizeof(tc->buf), "%F ", &tm);
+    tc->have_minute = 0; /* clock part not rendered yet */
+    stats_end(&st, PH_TIME);
+    return 0;
+}
+
+/*
+ * Same as strftime("%F %H:%M") of localtime(), but localtime() only runs
+ * when the date or the UTC offset changes. Entries of one directory tend
+ * to share both.
+ */
+static char* fmt_time(struct fmtctx_t *c, time_t t) {
+    static pthread_once_t tz_once = PTHREAD_ONCE_INIT;
+    struct timecache_t *tc = &c->tc;
+    long sec;
+    char *p;
+
+    pthread_once(&tz_once, tz_init);
+    if (tc->have_minute && t >= tc->minute && t - tc->minute < 60) {
+        return tc->buf;
+    }
+    if (!(t >= tc->lo && t < tc->hi) && time_miss(tc, t) != 0) {
+        snprintf(tc->buf, sizeof(tc->buf), "%ld", (long)t);
+        tc->lo = tc->hi = 0;
+        tc->have_minute = 0;
+        return tc->buf;
+    }
+    sec = tc->base + (t - tc->lo);
+    tc->minute = t - sec % 60;
+    tc->have_minute = 1;
+    p = tc->buf + tc->prefix;
+    p[0] = '0' + sec / 36000;
+    p[1] = '0' + sec / 3600 % 10;
+    p[2] = ':';
+    p[3] = '0' + sec / 600 % 6;
+    p[4] = '0' + sec / 60 % 10;
+    p[5] = '\0';
+    return tc->buf;
+}
+
+/*
+ * name, plus " -> target" for links, straight into out. The target is
+ * read with the size stat reported as a hint; links that report no size
+ * (procfs) start at PATH_MAX. Returns -1 with errno set when the link can
+ * not be read, the name is rendered anyway.
+ */
+static int fmt_name(struct fmtctx_t *c, struct table_t *t, uint32_t i) {
+    struct outbuf_t *out = c->out;
+    size_t size;
+    ssize_t len;
+    char *p;
+
+    out_mem(out, tname(t, i), t->len[i]);
+    if (!S_ISLNK(t->mode[i])) {
+        return 0;
+    }
+    size = t->size[i] > 0 ? (size_t)t->size[i] + 1 : PATH_MAX;
+    for (;;) {
+        p = out_reserve(out, size + 4);
+        len = readlinkat(t->dirfd, tname(t, i), p + 4, size);
+        t_stats.sys[SC_READLINK]++;
+        if (len == -1) {
+            return -1;
+        }
+        if ((size_t)len < size) {
+            memcpy(p, " -> ", 4);
+            out->len += len + 4;
+            return 0;
+        }
+        size *= 2; /* the link changed since it was stat'ed */
+    }
+}
+
+/* v rounded to the nearest double, halfway cases to even, as (double)v */
+static unsigned long round_double(unsigned long v) {
+    int drop = 64 - __builtin_clzl(v | 1) - 53;
+    unsigned long low, half;
+
+    if (drop <= 0) return v;
+    low = v & ((1UL << drop) - 1);
+    half = 1UL << (drop - 1);
+    v >>= drop;
+    if (low > half || (low == half && (v & 1))) v++;
+    return v << drop;
+}
+
+/*
+ * -h rendering of size >= ONE_KB into buf (at least 24 bytes), returns
+ * its length. Same as "%6.1fK" of size / (double)ONE_KB and the M and G
+ * variants, without floating point: the quotient is exact in binary, so
+ * the tenths are rounded like printf does, halfway cases to even.
+ */
+static int fmt_human(char *buf, size_t len, off_t size) {
+    unsigned long m = round_double(size), mask, rem, tenths;
+    char tmp[24], *end = tmp + sizeof(tmp), *p = end;
+    int shift = 10, n;
+
+    *--p = 'K';
+    if (size >= ONE_GB) {
+        shift = 30;
+        *p = 'G';
+    } else if (size >= ONE_MB) {
+        shift = 20;
+        *p = 'M';
+    }
+    mask = (1UL << shift) - 1;
+    rem = (m & mask) * 10;
+    tenths = (m >> shift) * 10 + (rem >> shift);
+    rem &= mask;
+    if (rem > (mask + 1) / 2 || (rem == (mask + 1) / 2 && (tenths & 1))) {
+        tenths++;
+    }
+    *--p = '0' + tenths % 10;
+    *--p = '.';
+    p = fmt_ulong(p, tenths / 10);
+    while (end - p < 7) *--p = ' ';
+    n = end - p;
+    if ((size_t)n >= len) n = len - 1;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    return n;
+}
+
+static void fmt_size(struct fmtctx_t *c, off_t size) {
+    struct outbuf_t *out = c->out;
+    int width = c->w->size, n;
+    char buf[32];
+
+    if (c->opt->human == 0 || size < ONE_KB) {
+        out_num_right(out, size, width);
+        return;
+    }
+    n = fmt_human(buf, sizeof(buf), size);
+    out_pad(out, width - n);
+    out_mem(out, buf, n);
+}
+
+/* number of decimal digits of v */
+static int ndigits(unsigned long v) {
+    static const unsigned long pow10[] = {
+        1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL,
+        100000000UL, 1000000000UL, 10000000000UL, 100000000000UL,
+        1000000000000UL, 10000000000000UL, 100000000000000UL,
+        1000000000000000UL, 10000000000000000UL, 100000000000000000UL,
+        1000000000000000000UL, 10000000000000000000UL
+    };
+    int t = ((64 - __builtin_clzl(v | 1)) * 1233) >> 12; /* bits * log10(2) */
+
+    if (v == 0) return 1;
+    return t - (v < pow10[t]) + 1;
+}
+
+static void widths_init(struct widths_t *w) {
+    w->ino = 6;
+    w->nlink = 2;
+    w->size = 7;
+}
+
+/*
+ * Widen w to fit entries [from, to) of t in output order, so the lines
+ * line up however large the numbers get. -h sizes below 9999.95G always
+ * fit the default.
+ */
+static void widths_update(struct fmtctx_t *c, struct table_t *t,
+                          uint32_t from, uint32_t to) {
+    struct widths_t *w = c->w;
+    unsigned long ino = 0, nlink = 0, size = 0;
+    char buf[32];
+    uint32_t k, i;
+    int n;
+
+    for (k = from; k < to; k++) {
+        i = t->order ? t->order[k] : k;
+        if (t->err[i] != 0) continue;
+        if (t->ino[i] > ino) ino = t->ino[i];
+        if (t->nlink[i] > nlink) nlink = t->nlink[i];
+        if ((unsigned long)t->size[i] > size) size = t->size[i];
+    }
+    if (ndigits(ino) > w->ino) w->ino = ndigits(ino);
+    if (ndigits(nlink) > w->nlink) w->nlink = ndigits(nlink);
+    if (!c->opt->human || size < ONE_KB) {
+        n = ndigits(size);
+    } else if (size >= 9999UL * ONE_GB) {
+        n = fmt_human(buf, sizeof(buf), size);
+    } else {
+        n = 7;
+    }
+    if (n > w->size) w->size = n;
+}
+
+/* the -F/--file-type indicator of mode, 0 for none */
+static char indicator(struct fmtctx_t *c, mode_t mode) {
+    if (c->opt->classify == 0) return 0;
+    if (S_ISDIR(mode)) return '/';
+    if (S_ISLNK(mode)) return '@';
+    if (S_ISFIFO(mode)) return '|';
+    if (S_ISSOCK(mode)) return '=';
+    if (c->opt->classify == CLASSIFY_EXEC && S_ISREG(mode) &&
+        (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0) {
+        return '*';
+    }
+    return 0;
+}
+
+/* -1 output, the mode may hold only the file type bits */
+static void pr_short(struct fmtctx_t *c, struct table_t *t, uint32_t i) {
+    char ind = indicator(c, t->mode[i]);
+
+    out_mem(c->out, tname(t, i), t->len[i]);
+    if (ind != 0) out_char(c->out, ind);
+    out_eol(c->out);
+}
+
+/*
+ * Whether printing a file of DT_* type needs stat data. The short format
+ * gets by with the type from the directory entry unless the file system
+ * does not report it, '*' needs the permission bits, and -L needs to know
+ * what a link points to for the indicator and for -R.
+ */
+static int need_stat(unsigned char type) {
+    if (!g_args.shortfmt || type == DT_UNKNOWN || g_args.du) return 1;
+    if (g_args.format != FMT_TEXT) return 1;
+    if (g_args.sortkey != SORT_NAME && !g_args.unsorted) return 1;
+    if (g_args.classify == CLASSIFY_EXEC && type == DT_REG) return 1;
+    return g_args.follow && type == DT_LNK &&
+           (g_args.classify != 0 || g_args.recursive);
+}
+
+/*
+ * The target of link i of t into buf, not NUL terminated. Returns its
+ * length, -1 with errno set on error.
+ */
+static ssize_t link_target(struct table_t *t, uint32_t i, char *buf,
+                           size_t size) {
+    t_stats.sys[SC_READLINK]++;
+    return readlinkat(t->dirfd, tname(t, i), buf, size);
+}
+
+/* length of the UTF-8 sequence at p, 0 if it isn't a valid one */
+static int utf8_len(const unsigned char *p, const unsigned char *end) {
+    unsigned char lo = 0x80, hi = 0xbf;
+    int n, k;
+
+    if (*p < 0x80) return 1;
+    if (*p >= 0xc2 && *p <= 0xdf) {
+        n = 2;
+    } else if (*p >= 0xe0 && *p <= 0xef) {
+        n = 3;
+        if (*p == 0xe0) lo = 0xa0;
+        if (*p == 0xed) hi = 0x9f; /* no surrogates */
+    } else if (*p >= 0xf0 && *p <= 0xf4) {
+        n = 4;
+        if (*p == 0xf0) lo = 0x90;
+        if (*p == 0xf4) hi = 0x8f;
+    } else {
+        return 0;
+    }
+    if (end - p < n || p[1] < lo || p[1] > hi) return 0;
+    for (k = 2; k < n; k++) {
+        if ((p[k] & 0xc0) != 0x80) return 0;
+    }
+    return n;
+}
+
+/*
+ * s as a JSON string. Bytes that are not valid UTF-8 are written as
+ * \u00XX, which loses them: returns 1 if there were any.
+ */
+static int out_json_str(struct outbuf_t *out, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char*)s, *end = p + n, *run;
+    char *q;
+    int k, bad = 0;
+
+    out_char(out, '"');
+    while (p < end) {
+        for (run = p; p < end; p += k) {
+            if (*p < 0x20 || *p == '"' || *p == '\\') break;
+            if ((k = utf8_len(p, end)) == 0) break;
+        }
+        out_mem(out, (const char*)run, p - run);
+        if (p == end) break;
+        q = out_reserve(out, 6);
+        if (*p == '"' || *p == '\\') {
+            q[0] = '\\';
+            q[1] = *p;
+            out->len += 2;
+        } else {
+            bad |= *p >= 0x80;
+            memcpy(q, "\\u00", 4);
+            q[4] = hex[*p >> 4];
+            q[5] = hex[*p & 15];
+            out->len += 6;
+        }
+        p++;
+    }
+    out_char(out, '"');
+    return bad;
+}
+
+/*
+ * The member "key":s. A name that is not valid UTF-8 also gets its bytes
+ * base64 encoded in "key_b64", since names are bytes to the kernel.
+ */
+static void out_json_member(struct outbuf_t *out, const char *key,
+                            const char *s, size_t n) {
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char*)s;
+    uint32_t v;
+    size_t i;
+    char *q;
+
+    out_char(out, '"');
+    out_str(out, key);
+    out_str(out, "\":");
+    if (!out_json_str(out, s, n)) return;
+    out_str(out, ",\"");
+    out_str(out, key);
+    out_str(out, "_b64\":\"");
+    for (i = 0; i < n; i += 3) {
+        v = p[i] << 16 | (i + 1 < n ? p[i+1] << 8 : 0) |
+            (i + 2 < n ? p[i+2] : 0);
+        q = out_reserve(out, 4);
+        q[0] = b64[v >> 18];
+        q[1] = b64[v >> 12 & 63];
+        q[2] = i + 1 < n ? b64[v >> 6 & 63] : '=';
+        q[3] = i + 2 < n ? b64[v & 63] : '=';
+        out->len += 4;
+    }
+    out_char(out, '"');
+}
+
+static void out_json_num(struct outbuf_t *out, const char *key, long v) {
+    out_char(out, ',');
+    out_str(out, key);
+    out_num_right(out, v, 0);
+}
+
+static const char* json_type(mode_t mode) {
+    if (S_ISREG(mode)) return "file";
+    if (S_ISDIR(mode)) return "dir";
+    if (S_ISLNK(mode)) return "link";
+    if (S_ISFIFO(mode)) return "fifo";
+    if (S_ISSOCK(mode)) return "socket";
+    if (S_ISCHR(mode)) return "char";
+    if (S_ISBLK(mode)) return "block";
+    return "unknown";
+}
+
+static void pr_json(struct fmtctx_t *c, struct table_t *t, uint32_t i,
+                    char *target, ssize_t tlen) {
+    struct outbuf_t *out = c->out;
+    char *name;
+
+    out_char(out, '{');
+    out_json_member(out, "name", tname(t, i), t->len[i]);
+    if (t->err[i] != 0) {
+        out_char(out, ',');
+        name = strerror(t->err[i]);
+        out_json_member(out, "error", name, strlen(name));
+        out_str(out, "}\n");
+        return;
+    }
+    out_str(out, ",\"type\":\"");
+    out_str(out, json_type(t->mode[i]));
+    out_char(out, '"');
+    out_json_num(out, "\"ino\":", t->ino[i]);
+    out_json_num(out, "\"nlink\":", t->nlink[i]);
+    out_json_num(out, "\"mode\":", t->mode[i]);
+    out_json_num(out, "\"uid\":", t->uid[i]);
+    out_json_num(out, "\"gid\":", t->gid[i]);
+    out_json_num(out, "\"size\":", t->size[i]);
+    out_json_num(out, "\"blocks\":", t->blocks[i]);
+    out_json_num(out, "\"mtime\":", t->mtime[i]);
+    out_json_num(out, "\"mtime_ns\":", t->mtime_ns[i]);
+    if (c->opt->owner_names) {
+        if (*(name = fmt_owner(t->uid[i])) != '\0') {
+            out_char(out, ',');
+            out_json_member(out, "user", name, strlen(name));
+        }
+        if (*(name = fmt_group(t->gid[i])) != '\0') {
+            out_char(out, ',');
+            out_json_member(out, "group", name, strlen(name));
+        }
+    }
+    if (tlen >= 0) {
+        out_char(out, ',');
+        out_json_member(out, "target", target, tlen);
+    }
+    out_str(out, "}\n");
+}
+
+static void pr_binary(struct fmtctx_t *c, struct table_t *t, uint32_t i,
+                      char *target, ssize_t tlen) {
+    struct outbuf_t *out = c->out;
+    struct bin_rec_t r;
+    const char *user = "", *group = "";
+    size_t len;
+    char *p;
+
+    memset(&r, 0, sizeof(r));
+    r.kind = BIN_ENTRY;
+    r.type = t->type[i];
+    r.name_len = t->len[i];
+    r.err = t->err[i];
+    if (r.err == 0) {
+        r.target_len = tlen >= 0 ? tlen : 0;
+        r.mode = t->mode[i];
+        r.nlink = t->nlink[i];
+        r.uid = t->uid[i];
+        r.gid = t->gid[i];
+        r.mtime = t->mtime[i];
+        r.mtime_ns = t->mtime_ns[i];
+        r.ino = t->ino[i];
+        r.size = t->size[i];
+        r.blocks = t->blocks[i];
+        if (c->opt->owner_names) {
+            user = fmt_owner(t->uid[i]);
+            group = fmt_group(t->gid[i]);
+        }
+        r.user_len = strlen(user);
+        r.group_len = strlen(group);
+    }
+    len = sizeof(r) + r.name_len + r.target_len + r.user_len + r.group_len;
+    r.len = (len + 7) & ~(size_t)7;
+    p = out_reserve(out, r.len);
+    memcpy(p, &r, sizeof(r));
+    p += sizeof(r);
+    memcpy(p, tname(t, i), r.name_len);
+    p += r.name_len;
+    memcpy(p, target, r.target_len);
+    p += r.target_len;
+    memcpy(p, user, r.user_len);
+    p += r.user_len;
+    memcpy(p, group, r.group_len);
+    memset(p + r.group_len, 0, r.len - len);
+    out->len += r.len;
+}
+
+/* entry i of t as a --format record, -1 if its link can't be read */
+static int pr_record(struct fmtctx_t *c, struct table_t *t, uint32_t i) {
+    char target[PATH_MAX];
+    ssize_t tlen = -1;
+    int ret = 0;
+
+    if (t->err[i] == 0 && S_ISLNK(t->mode[i])) {
+        tlen = link_target(t, i, target, sizeof(target));
+        if (tlen == -1) ret = -1;
+    }
+    if (c->opt->format == FMT_NDJSON) {
+        pr_json(c, t, i, target, tlen);
+    } else {
+        pr_binary(c, t, i, target, tlen);
+    }
+    return ret;
+}
+
+/* start of the entries of dir in --format output */
+static void pr_dir_record(struct fmtctx_t *c, char *dir) {
+    struct outbuf_t *out = c->out;
+    struct bin_rec_t r;
+    size_t n = strlen(dir), len;
+    char *p;
+
+    if (c->opt->format == FMT_NDJSON) {
+        out_char(out, '{');
+        out_json_member(out, "dir", dir, n);
+        out_str(out, "}\n");
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    r.kind = BIN_DIR;
+    r.name_len = n > UINT16_MAX ? UINT16_MAX : n;
+    len = sizeof(r) + r.name_len;
+    r.len = (len + 7) & ~(size_t)7;
+    p = out_reserve(out, r.len);
+    memcpy(p, &r, sizeof(r));
+    memcpy(p + sizeof(r), dir, r.name_len);
+    memset(p + len, 0, r.len - len);
+    out->len += r.len;
+}
+
+/*
+ * Render the long format line of one entry into c->out. Returns -1 with
+ * errno set if the line is missing the target of a link.
+ */
+static int pr_line(struct fmtctx_t *c, struct table_t *t, uint32_t i) {
+    struct outbuf_t *out = c->out;
+    struct widths_t *w = c->w;
+    int ret;
+
+    out_num_left(out, t->ino[i], w->ino);
+    out_char(out, ' ');
+    out_num_left(out, t->nlink[i], w->nlink);
+    out_char(out, ' ');
+    fmt_mode(out, t->mode[i]);
+    out_char(out, ' ');
+    if (c->opt->numeric) {
+        out_num_left(out, t->uid[i], 8);
+        out_char(out, ' ');
+        out_num_left(out, t->gid[i], 8);
+    } else {
+        out_str_left(out, fmt_owner(t->uid[i]), 8);
+        out_char(out, ' ');
+        out_str_left(out, fmt_group(t->gid[i]), 8);
+    }
+    out_char(out, ' ');
+    fmt_size(c, t->size[i]);
+    out_char(out, ' ');
+    out_str(out, fmt_time(c, t->mtime[i]));
+    out_char(out, ' ');
+    ret = fmt_name(c, t, i);
+    if (!S_ISLNK(t->mode[i]) && indicator(c, t->mode[i]) != 0) {
+        out_char(out, indicator(c, t->mode[i]));
+    }
+    out_eol(out);
+    return ret;
+}
+
+static int skip(char *file) {
+    if (g_args.all) {
+        return 0;
+    }
+    if (g_args.almost && 
+        (strcmp(file, ".") != 0 && strcmp(file, "..") != 0)) {
+        return 0;
+    }
+    if (file[0] == '.') {
+        return 1;
+    }
+    return 0;
+}
+
+/* the arrays stat_range() fills in, table_grow() keeps them in step */
+static void table_stat_init(struct table_t *t) {
+    t->nlink = arena_alloc(t->arena, sizeof(uint32_t) * t->cap);
+    t->mode = arena_alloc(t->arena, sizeof(uint32_t) * t->cap);
+    t->uid = arena_alloc(t->arena, sizeof(uint32_t) * t->cap);
+    t->gid = arena_alloc(t->arena, sizeof(uint32_t) * t->cap);
+    t->size = arena_alloc(t->arena, sizeof(int64_t) * t->cap);
+    t->mtime = arena_alloc(t->arena, sizeof(int64_t) * t->cap);
+    t->blocks = arena_alloc(t->arena, sizeof(int64_t) * t->cap);
+    t->mtime_ns = arena_alloc(t->arena, sizeof(uint32_t) * t->cap);
+    t->err = arena_alloc(t->arena, sizeof(int) * t->cap);
+    if (g_args.du) {
+        t->dev = arena_alloc(t->arena, sizeof(uint64_t) * t->cap);
+    }
+}
+
+static void* stat_worker(void *arg) {
+    struct stat_job_t *job = arg;
+    struct table_t *t = job->t;
+    uint32_t i, end;
+
+    for (;;) {
+        i = __atomic_fetch_add(&job->next, STAT_CHUNK, __ATOMIC_RELAXED);
+        if (i >= job->to) break;
+        end = i + STAT_CHUNK < job->to ? i + STAT_CHUNK : job->to;
+        for (; i < end; i++) {
+            if (!need_stat(t->type[i])) {
+                t->mode[i] = DTTOIF(t->type[i]);
+                t->err[i] = 0;
+                continue;
+            }
+            t->err[i] = get_stat(t, i) == 0 ? 0 : errno;
+        }
+    }
+    return NULL;
+}
+
+/* stat_worker() of the threads stat_range() starts */
+static void* stat_thread(void *arg) {
+    struct stimer_t st;
+
+    stats_start(&st);
+    stat_worker(arg);
+    stats_end_cpu(&st, PH_STAT);
+    stats_flush();
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static void uring_free(struct uring_t *r) {
+    if (r == NULL) return;
+    if (r->sqes != NULL) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != NULL) munmap(r->sq_ptr, r->sq_len);
+    if (r->fd != -1) close(r->fd);
+    free(r);
+}
+
+/*
+ * Set up the ring of the calling thread, NULL if the kernel has no
+ * io_uring or no statx for it, or won't let us use it.
+ */
+static struct uring_t* uring_new(void) {
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    struct uring_t *r;
+    size_t size;
+    int i, ok;
+
+    r = calloc(1, sizeof(struct uring_t));
+    if (r == NULL) return NULL;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        uring_free(r);
+        return NULL;
+    }
+    size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, size);
+    ok = probe != NULL &&
+         syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+                 probe, 256) == 0 &&
+         probe->last_op >= IORING_OP_STATX &&
+         (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok) {
+        uring_free(r);
+        return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            uring_free(r);
+            return NULL;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+    for (i = 0; i < URING_DEPTH; i++) {
+        r->free[i] = i;
+    }
+    return r;
+}
+
+/*
+ * Stat entries [from, to) of t with up to URING_DEPTH statx requests in
+ * flight from this one thread. Each round queues every free slot, submits
+ * them with one io_uring_enter() that waits for half the ring (or all that
+ * is left) and fills in whatever completed, in any order. Returns -1 if there is no ring to use, before touching t.
+ */
+static int uring_stat(struct table_t *t, uint32_t from, uint32_t to) {
+    int flags = (g_args.follow ? 0 : AT_SYMLINK_NOFOLLOW) | AT_STATX_DONT_SYNC;
+    struct uring_t *r = t_ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail, head, queued, wait;
+    uint32_t i = from, slot, nfree = URING_DEPTH;
+    long ret;
+
+    if (r == NULL) {
+        if (t_no_ring || (r = t_ring = uring_new()) == NULL) {
+            t_no_ring = 1;
+            return -1;
+        }
+    }
+    while (i < to || nfree < URING_DEPTH) {
+        tail = *r->sq_tail;
+        for (queued = 0; i < to && nfree > 0; i++) {
+            if (!need_stat(t->type[i])) {
+                t->mode[i] = DTTOIF(t->type[i]);
+                t->err[i] = 0;
+                continue;
+            }
+            slot = r->free[--nfree];
+            r->entry[slot] = i;
+            sqe = &r->sqes[tail & *r->sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = t->dirfd;
+            sqe->addr = (uintptr_t)tname(t, i);
+            sqe->len = STATX_LS_MASK;
+            sqe->off = (uintptr_t)&r->stx[slot];
+            sqe->statx_flags = flags;
+            sqe->user_data = slot;
+            r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        if (nfree == URING_DEPTH) break; /* nothing needed a stat */
+        /* reap half a ring per enter, not the first few to arrive */
+        wait = URING_DEPTH - nfree;
+        if (wait > URING_DEPTH / 2) wait = URING_DEPTH / 2;
+        do {
+            ret = syscall(__NR_io_uring_enter, r->fd, queued, wait,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+            t_stats.sys[SC_URING]++;
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1) {
+            err_sys("ls: io_uring_enter");
+            exit(1);
+        }
+        head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &r->cqes[head & *r->cq_mask];
+            slot = cqe->user_data;
+            if (cqe->res < 0) {
+                t->err[r->entry[slot]] = -cqe->res;
+            } else {
+                set_statx(t, r->entry[slot], &r->stx[slot]);
+                t->err[r->entry[slot]] = 0;
+            }
+            r->free[nfree++] = slot;
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Stat entries [from, to) of t, through io_uring when asked for or else
+ * spread over g_args.jobs threads when there are enough of them to pay
+ * for it. The stat arrays are allocated for the whole table on first use.
+ * Walkers listing several large directories at once share the
+ * g_args.jobs - 1 helper threads rather than each starting its own.
+ */
+static void stat_range(struct table_t *t, uint32_t from, uint32_t to) {
+    pthread_t tids[MAX_JOBS];
+    struct stat_job_t job;
+    uint32_t i;
+    int nthreads = 0;
+    struct stimer_t st;
+
+    stats_start(&st);
+    if (t->err == NULL && t->cap > 0) {
+        table_stat_init(t);
+    }
+#ifdef HAVE_IO_URING
+    if (g_args.uring && uring_stat(t, from, to) == 0) {
+        stats_end(&st, PH_STAT);
+        return;
+    }
+#endif
+    job.t = t;
+    job.from = job.next = from;
+    job.to = to;
+    job.nstat = 0;
+    for (i = from; i < to; i++) {
+        if (need_stat(t->type[i])) job.nstat++;
+    }
+    if (job.nstat >= PARALLEL_MIN && job_count() > 1) {
+        for (i = 0; i < (uint32_t)g_args.jobs - 1; i++) {
+            if (__atomic_add_fetch(&g_stat_threads, 1, __ATOMIC_RELAXED) >
+                    g_args.jobs - 1 ||
+                pthread_create(&tids[i], NULL, stat_thread, &job) != 0) {
+                __atomic_sub_fetch(&g_stat_threads, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            nthreads++;
+        }
+    }
+    stat_worker(&job); /* the calling thread does its share */
+    for (i = 0; i < (uint32_t)nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    __atomic_sub_fetch(&g_stat_threads, nthreads, __ATOMIC_RELAXED);
+    stats_end(&st, PH_STAT);
+}
+
+/* the stat_range() fields of entry i of src into entry j of dst */
+static void table_copy_stat(struct table_t *dst, uint32_t j,
+                            struct table_t *src, uint32_t i) {
+    dst->nlink[j] = src->nlink[i];
+    dst->mode[j] = src->mode[i];
+    dst->uid[j] = src->uid[i];
+    dst->gid[j] = src->gid[i];
+    dst->size[j] = src->size[i];
+    dst->mtime[j] = src->mtime[i];
+    dst->mtime_ns[j] = src->mtime_ns[i];
+    dst->blocks[j] = src->blocks[i];
+    if (dst->dev != NULL && src->dev != NULL) {
+        dst->dev[j] = src->dev[i];
+    }
+    dst->err[j] = src->err[i];
+}
+
+/*
+ * Whether entry i of t is left out of the listing, by skip() or by the
+ * patterns. Once t is stat'ed the mode decides what is a directory.
+ */
+static int entry_hidden(struct table_t *t, uint32_t i) {
+    unsigned char type = t->type[i];
+
+    if (skip(tname(t, i))) return 1;
+    if (g_filter.nignore + g_filter.ninclude == 0) return 0;
+    if (t->err != NULL && t->err[i] == 0) {
+        type = S_ISDIR(t->mode[i]) ? DT_DIR : DT_REG;
+    }
+    return name_filtered(tname(t, i), t->len[i], type);
+}
+
+/*
+ * Drop the entries entry_hidden() hides, before anything is spent on them
+ * unless --du needs them stat'ed. t is either not stat'ed at all or
+ * stat'ed whole.
+ */
+static void table_filter(struct table_t *t) {
+    uint32_t i, n;
+
+    for (i = n = 0; i < t->n; i++) {
+        if (entry_hidden(t, i)) continue;
+        t->name[n] = t->name[i];
+        t->len[n] = t->len[i];
+        t->type[n] = t->type[i];
+        t->ino[n] = t->ino[i];
+        if (t->err != NULL) {
+            table_copy_stat(t, n, t, i);
+        }
+        n++;
+    }
+    t->n = n;
+}
+
+/*
+ * Entry i of t into c->out. Returns the err_sys() message for entries
+ * that can't be printed whole, with errno set, NULL for the others.
+ */
+static const char* pr_entry(struct fmtctx_t *c, struct table_t *t,
+                            uint32_t i) {
+    if (c->opt->format != FMT_TEXT) {
+        return pr_record(c, t, i) != 0 ? "ls: can not read link %s" : NULL;
+    }
+    if (t->err[i] != 0) {
+        errno = t->err[i];
+        return "ls: can not access %s";
+    }
+    if (c->opt->shortfmt) {
+        pr_short(c, t, i);
+        return NULL;
+    }
+    return pr_line(c, t, i) != 0 ? "ls: can not read link %s" : NULL;
+}
+
+/* entries [from, to) of t in output order into g_out */
+static void print_serial(struct table_t *t, uint32_t from, uint32_t to) {
+    const char *msg;
+    uint32_t k, i;
+
+    for (k = from; k < to; k++) {
+        i = t->order ? t->order[k] : k;
+        if ((msg = pr_entry(&g_fmt, t, i)) != NULL) {
+            err_sys(msg, tname(t, i));
+        }
+    }
+}
+
+/* render the slice of job into its buffer, up to the first failing entry */
+static void render_slice(struct render_job_t *job) {
+    uint32_t k, i;
+
+    job->stop = job->to;
+    for (k = job->from; k < job->to; k++) {
+        i = job->t->order ? job->t->order[k] : k;
+        if ((job->msg = pr_entry(&job->c, job->t, i)) != NULL) {
+            job->stop = k;
+            job->err = errno;
+            break;
+        }
+    }
+}
+
+static void* render_thread(void *arg) {
+    struct stimer_t st;
+
+    stats_start(&st);
+    render_slice(arg);
+    stats_end_cpu(&st, PH_FORMAT);
+    stats_flush();
+    return NULL;
+}
+
+/* what out holds, then the n buffers of v, with as few writev()s as it takes */
+static void out_writev(struct outbuf_t *out, struct iovec *v, int n) {
+    struct iovec all[MAX_JOBS + 1], *p = all;
+    struct stimer_t st;
+    ssize_t len;
+
+    stats_start(&st);
+    all[0].iov_base = out->buf;
+    all[0].iov_len = out->len;
+    memcpy(all + 1, v, sizeof(*v) * n);
+    for (n++; n > 0; ) {
+        len = writev(out->fd, p, n);
+        t_stats.sys[SC_WRITE]++;
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            out->len = 0;
+            fprintf(stderr, "ls: write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        t_stats.written += len;
+        while (n > 0 && (size_t)len >= p->iov_len) {
+            len -= p->iov_len;
+            p++;
+            n--;
+        }
+        if (n > 0) {
+            p->iov_base = (char*)p->iov_base + len;
+            p->iov_len -= len;
+        }
+    }
+    out->len = 0;
+    stats_end(&st, PH_WRITE);
+}
+
+/*
+ * Entries [from, to) of t in output order, rendered by up to g_args.jobs
+ * threads RENDER_CHUNK entries each into buffers of their own, which are
+ * written in order. An entry that fails ends its thread's slice, the
+ * error is reported in place and the rest of the slice printed here.
+ */
+static void print_parallel(struct table_t *t, uint32_t from, uint32_t to) {
+    static struct render_job_t jobs[MAX_JOBS];
+    pthread_t tids[MAX_JOBS];
+    struct iovec v[MAX_JOBS];
+    struct render_job_t *job;
+    uint32_t k, i;
+    int n, j, nthreads, nv;
+
+    if (g_args.format == FMT_TEXT ? !g_args.shortfmt && !g_args.numeric :
+        g_args.owner_names) {
+        idcache_fill(t, from, to);
+    }
+    memset(jobs, 0, sizeof(jobs));
+    for (k = from; k < to; ) {
+        n = (to - k + RENDER_CHUNK - 1) / RENDER_CHUNK;
+        if (n > g_args.jobs) n = g_args.jobs;
+        for (j = 0; j < n; j++) {
+            job = &jobs[j];
+            job->c.opt = &g_args;
+            job->c.out = &job->out;
+            job->c.w = g_fmt.w;
+            job->out.fd = -1;
+            job->out.len = 0;
+            job->t = t;
+            job->from = k;
+            job->to = k = to - k > RENDER_CHUNK ? k + RENDER_CHUNK : to;
+        }
+        for (nthreads = 1; nthreads < n; nthreads++) {
+            if (pthread_create(&tids[nthreads], NULL, render_thread,
+                               &jobs[nthreads]) != 0) {
+                break;
+            }
+        }
+        for (j = nthreads; j < n; j++) {
+            render_slice(&jobs[j]);
+        }
+        render_slice(&jobs[0]);
+        for (j = 1; j < nthreads; j++) {
+            pthread_join(tids[j], NULL);
+        }
+        for (j = nv = 0; j < n; j++) {
+            job = &jobs[j];
+            v[nv].iov_base = job->out.buf;
+            v[nv++].iov_len = job->out.len;
+            if (job->stop == job->to) continue;
+            out_writev(&g_out, v, nv);
+            nv = 0;
+            errno = job->err;
+            i = t->order ? t->order[job->stop] : job->stop;
+            err_sys(job->msg, tname(t, i));
+            print_serial(t, job->stop + 1, job->to);
+        }
+        out_writev(&g_out, v, nv);
+    }
+    for (j = 0; j < g_args.jobs && j < MAX_JOBS; j++) {
+        free(jobs[j].out.buf);
+    }
+}
+
+/* entries [from, to) of t in output order, w is widened to fit them first */
+static void print_range(struct outbuf_t *out, struct table_t *t,
+                        uint32_t from, uint32_t to, struct widths_t *w) {
+    struct stimer_t st;
+
+    stats_start(&st);
+    g_fmt.out = out;
+    g_fmt.w = w;
+    if (g_args.format == FMT_TEXT && !g_args.shortfmt) {
+        widths_update(&g_fmt, t, from, to);
+    }
+    if (to - from >= 2 * RENDER_CHUNK && !out->line_flush && job_count() > 1) {
+        print_parallel(t, from, to);
+    } else {
+        print_serial(t, from, to);
+    }
+    stats_end(&st, PH_FORMAT);
+}
+
+/* how many of the n entries of a listing to print */
+static uint32_t head_count(uint32_t n) {
+    return g_args.head != 0 && g_args.head < n ? g_args.head : n;
+}
+
+/* filter, stat, sort and print all of t */
+static void do_files(struct table_t *t) {
+    struct widths_t w;
+
+    table_filter(t);
+    stat_range(t, 0, t->n);
+    if (!g_args.unsorted) {
+        sort(t, t->arena);
+    }
+    widths_init(&w);
+    print_range(&g_out, t, 0, head_count(t->n), &w);
+}
+
+/* close the directory, the memory goes with the table's arena */
+static void table_close(struct table_t *t) {
+    if (t->dirfd != -1) {
+        close(t->dirfd);
+        t->dirfd = -1;
+    }
+}
+
+/*
+ * Open name relative to at as a table allocating from a. Returns -1 with
+ * errno set on error.
+ */
+static int table_open(struct table_t *t, int at, char *name,
+                      struct arena_t *a) {
+    table_init(t, a, openat(at, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    t_stats.sys[SC_OPEN]++;
+    return t->dirfd == -1 ? -1 : 0;
+}
+
+/*
+ * Append the next getdents64 batch of the directory to t, at most len
+ * bytes of dirents. Returns 1 if entries were read, 0 at the end of the
+ * directory and -1 with errno set on error.
+ */
+static int table_read_max(struct table_t *t, size_t len) {
+    char *buf = t_dents;
+    long nread, pos;
+    struct stimer_t st;
+
+    stats_start(&st);
+    if (t_dents_size < len) {
+        buf = t_dents = xrealloc(t_dents, len);
+        t_dents_size = len;
+    }
+    nread = syscall(SYS_getdents64, t->dirfd, buf, len);
+    t_stats.sys[SC_GETDENTS]++;
+    if (nread == -1) {
+        stats_end(&st, PH_READ);
+        return -1;
+    }
+    for (pos = 0; pos < nread; ) {
+        struct linux_dirent64 *d = (struct linux_dirent64*)(buf + pos);
+        size_t len = strlen(d->d_name);
+
+        pos += d->d_reclen;
+        if (g_filter.nignore + g_filter.ninclude > 0 && !g_args.du &&
+            name_filtered(d->d_name, len, d->d_type)) {
+            continue;
+        }
+        table_add(t, d->d_name, len, d->d_type, d->d_ino);
+    }
+    stats_end(&st, PH_READ);
+    return nread > 0;
+}
+
+/*
+ * Append the next getdents64 batch of the directory to t. Returns 1 if
+ * entries were read, 0 at the end of the directory and -1 with errno set
+ * on error.
+ */
+static int table_read(struct table_t *t) {
+    return table_read_max(t, DENTS_BUFSIZE);
+}
+
+/* forget the entries of t, and everything else in its arena */
+static void table_reset(struct table_t *t) {
+    int fd = t->dirfd;
+
+    arena_reset(t->arena);
+    table_init(t, t->arena, fd);
+}
+
+/*
+ * Read all entries of dir with large getdents64 batches. Entries and
+ * names are bump allocated from a, so a huge directory costs a handful of
+ * allocations instead of one per entry. The directory is left open in
+ * t->dirfd until table_close().
+ */
+static int listdir(char *dir, struct table_t *t, struct arena_t *a) {
+    int ret;
+
+    if (table_open(t, AT_FDCWD, dir, a) != 0) {
+        err_sys("ls: can not access %s", dir);
+        return -1;
+    }
+    while ((ret = table_read(t)) > 0)
+        ;
+    if (ret == -1) {
+        err_sys("ls: can not read %s", dir);
+        table_close(t);
+        return -1;
+    }
+    return 0;
+}
+
+static void pr_header(char *dir) {
+    if (g_args.format != FMT_TEXT) {
+        pr_dir_record(&g_fmt, dir);
+    } else if (g_args.fc > 1 || g_args.recursive) {
+        out_char(&g_out, '\n');
+        out_str(&g_out, dir);
+        out_char(&g_out, ':');
+        out_eol(&g_out);
+    }
+}
+
+/*
+ * Unsorted listing: entries are printed in directory order as each
+ * getdents64 batch arrives, in slices of STREAM_CHUNK so the first lines
+ * show up right away. Memory stays at one batch however big dir is.
+ */
+static void stream_dir(char *dir) {
+    struct table_t t;
+    struct widths_t w; /* only ever grows, lines of later slices may shift */
+    unsigned long left = g_args.head ? g_args.head : ULONG_MAX;
+    uint32_t i, n;
+    int ret = 0;
+
+    if (table_open(&t, AT_FDCWD, dir, &g_arena) != 0) {
+        err_sys("ls: can not access %s", dir);
+        return;
+    }
+    pr_header(dir);
+    widths_init(&w);
+    while (left > 0 && (ret = table_read(&t)) > 0) {
+        table_filter(&t);
+        for (i = 0; i < t.n && left > 0; i += n) {
+            n = t.n - i < STREAM_CHUNK ? t.n - i : STREAM_CHUNK;
+            if (n > left) n = left;
+            stat_range(&t, i, i + n);
+            print_range(&g_out, &t, i, i + n, &w);
+            out_flush(&g_out);
+            left -= n;
+        }
+        table_reset(&t);
+    }
+    if (ret == -1) {
+        err_sys("ls: can not read %s", dir);
+    }
+    table_close(&t);
+    arena_reset(&g_arena);
+}
+
+static struct node_t* node_new(struct node_t *parent, char *name) {
+    struct node_t *node = calloc(1, sizeof(struct node_t));
+    size_t plen = 0, nlen = strlen(name);
+
+    if (node == NULL) {
+        err_sys("ls: no memory");
+        exit(1);
+    }
+    if (parent != NULL) {
+        plen = strlen(parent->path);
+        node->path = xrealloc(NULL, plen + nlen + 2);
+        memcpy(node->path, parent->path, plen);
+        if (plen > 0 && node->path[plen-1] != '/') {
+            node->path[plen++] = '/';
+        }
+    } else {
+        node->path = xrealloc(NULL, nlen + 1);
+    }
+    memcpy(node->path + plen, name, nlen + 1);
+    node->name = node->path + plen;
+    node->parent = parent;
+    node->refs = 1;
+    node->fd_users = 1;
+    node->slot = -1;
+    node->du_pending = 1;
+    node->quiet = parent != NULL && parent->quiet;
+    arena_init(&node->arena, NODE_ARENA_BLOCK);
+    table_init(&node->tab, &node->arena, -1);
+    return node;
+}
+
+/* one user less of the directory fd of node, the last one closes it */
+static void node_fd_release(struct node_t *node) {
+    if (__atomic_sub_fetch(&node->fd_users, 1, __ATOMIC_ACQ_REL) == 0 &&
+        node->tab.dirfd != -1) {
+        close(node->tab.dirfd);
+        node->tab.dirfd = -1;
+    }
+}
+
+/* drop a reference, freeing node and ancestors nobody needs any more */
+static void node_release(struct node_t *node) {
+    struct node_t *parent;
+
+    while (node != NULL &&
+           __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        parent = node->parent;
+        free(node->path);
+        free(node);
+        node = parent;
+    }
+}
+
+/* whether node is the same directory as one of its ancestors */
+static int node_is_cycle(struct node_t *node) {
+    struct node_t *p;
+
+    for (p = node->parent; p != NULL; p = p->parent) {
+        if (p->dev == node->dev && p->ino == node->ino) return 1;
+    }
+    return 0;
+}
+
+static void deque_push(struct deque_t *q, struct node_t *node) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->items, q->items + q->head,
+                    sizeof(struct node_t*) * (q->tail - q->head));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            q->cap = q->cap ? q->cap * 2 : 64;
+            q->items = xrealloc(q->items, sizeof(struct node_t*) * q->cap);
+        }
+    }
+    q->items[q->tail++] = node;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* owner end is the tail (depth first), thieves take the oldest node */
+static struct node_t* deque_take(struct deque_t *q, int steal) {
+    struct node_t *node = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        node = steal ? q->items[q->head++] : q->items[--q->tail];
+        if (q->head == q->tail) {
+            q->head = q->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return node;
+}
+
+static void walker_push(struct walker_t *w, int id, struct node_t *node) {
+    __atomic_add_fetch(&w->pending, 1, __ATOMIC_ACQ_REL);
+    deque_push(&w->deques[id], node);
+    __atomic_add_fetch(&w->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&w->lock);
+    if (w->idle > 0) {
+        pthread_cond_signal(&w->work);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Hand the walkers more roots while fewer than one per walker is being
+ * listed and the listed ones waiting for the printer take less than
+ * WALK_AHEAD_BYTES. One is always handed out when none is, the printer
+ * waits for it.
+ */
+static void walk_feed(struct walker_t *w) {
+    pthread_mutex_lock(&w->feed_lock);
+    while (w->next < w->nroots &&
+           (w->ahead == 0 || (w->ahead - w->ahead_done < w->nworkers &&
+                              w->ahead_bytes < WALK_AHEAD_BYTES))) {
+        w->ahead++;
+        walker_push(w, 0, w->roots[w->next++]);
+    }
+    if (w->next == w->nroots && w->feeding) {
+        pthread_mutex_lock(&w->lock);
+        w->feeding = 0;
+        pthread_cond_broadcast(&w->work);
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->feed_lock);
+}
+
+static struct idshard_t* id_shard(struct idshard_t *set, uint64_t dev,
+                                   uint64_t ino) {
+    uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ (ino * 0xff51afd7ed558ccdULL);
+    return &set[(h >> 32) & (ID_SHARDS - 1)];
+}
+
+/*
+ * Look (dev, ino) up in set and add it when add is set. Returns 1 the
+ * first time the pair is seen.
+ */
+static int id_first(struct idshard_t *set, uint64_t dev, uint64_t ino,
+                    int add) {
+    struct idshard_t *s = id_shard(set, dev, ino);
+    size_t i, mask, j, cap;
+    uint64_t *old;
+    int first = 1;
+
+    pthread_mutex_lock(&s->lock);
+    if (add && 2 * (s->n + 1) > s->cap) {
+        old = s->keys;
+        cap = s->cap;
+        s->cap = cap ? cap * 2 : 64;
+        s->keys = calloc(s->cap, 2 * sizeof(uint64_t));
+        if (s->keys == NULL) {
+            err_sys("ls: no memory");
+            exit(1);
+        }
+        for (j = 0; j < cap; j++) {
+            if (old[2*j+1] == 0) continue;
+            mask = s->cap - 1;
+            for (i = (old[2*j] * 31 + old[2*j+1]) & mask; s->keys[2*i+1] != 0;
+                 i = (i + 1) & mask)
+                ;
+            s->keys[2*i] = old[2*j];
+            s->keys[2*i+1] = old[2*j+1];
+        }
+        free(old);
+    }
+    mask = s->cap - 1;
+    for (i = (dev * 31 + ino) & mask; s->cap != 0 && s->keys[2*i+1] != 0;
+         i = (i + 1) & mask) {
+        if (s->keys[2*i] == dev && s->keys[2*i+1] == ino) {
+            first = 0;
+            break;
+        }
+    }
+    if (first && add) {
+        s->keys[2*i] = dev;
+        s->keys[2*i+1] = ino;
+        s->n++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return first;
+}
+
+/*
+ * Whether --skip-seen has listed the directory of node already. Only the
+ * printer adds to g_seen, in output order, so the path a directory is
+ * listed under doesn't depend on how the walkers race; they look here to
+ * skip walking what the printer is going to drop.
+ */
+static int node_seen(struct node_t *node) {
+    return g_args.skip_seen && !id_first(g_seen, node->dev, node->ino, 0);
+}
+
+/*
+ * Add the entries of node that are not directories to its --du totals,
+ * those entry_hidden() hides included. Hidden directories are walked as quiet
+ * children; they are stored in quiet, the number of them is returned.
+ */
+static int du_scan(struct node_t *node, struct node_t **quiet) {
+    struct table_t *t = &node->tab;
+    uint64_t blocks = 0, size = 0;
+    uint32_t i;
+    int n = 0;
+
+    for (i = 0; i < t->n; i++) {
+        char *name = tname(t, i);
+        if (t->err[i] != 0 || strcmp(name, ".") == 0 ||
+            strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (S_ISDIR(t->mode[i])) {
+            /* counted by the child itself */
+            if (entry_hidden(t, i)) {
+                quiet[n] = node_new(node, name);
+                quiet[n++]->quiet = 1;
+            }
+            continue;
+        }
+        if (t->nlink[i] > 1 && !id_first(g_links, t->dev[i], t->ino[i], 1)) {
+            continue;
+        }
+        blocks += t->blocks[i];
+        size += t->size[i];
+    }
+    node->du_blocks += blocks;
+    node->du_size += size;
+    return n;
+}
+
+/*
+ * One more part of the subtree of node is added up. The last one hands
+ * the totals of node to its parent, and so on up the tree.
+ */
+static void du_finish(struct walker_t *w, struct node_t *node) {
+    struct node_t *parent;
+    uint64_t blocks, size;
+
+    while (node != NULL &&
+           __atomic_sub_fetch(&node->du_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        parent = node->parent;
+        blocks = __atomic_load_n(&node->du_blocks, __ATOMIC_ACQUIRE);
+        size = __atomic_load_n(&node->du_size, __ATOMIC_ACQUIRE);
+        if (parent != NULL) {
+            if (node->slot >= 0) {
+                parent->tab.size[node->slot] = size;
+            }
+            __atomic_add_fetch(&parent->du_blocks, blocks, __ATOMIC_ACQ_REL);
+            __atomic_add_fetch(&parent->du_size, size, __ATOMIC_ACQ_REL);
+        }
+        /* the printer may free a node as soon as it is done */
+        if (node->quiet) {
+            node_release(node);
+        } else {
+            pthread_mutex_lock(&w->lock);
+            node->du_done = 1;
+            if (w->waiting == node) {
+                pthread_cond_signal(&w->done);
+            }
+            pthread_mutex_unlock(&w->lock);
+        }
+        node = parent;
+    }
+}
+
+/* read, sort and stat one directory and queue its subdirectories */
+static void walk_node(struct walker_t *w, int id, struct node_t *node) {
+    struct node_t *parent = node->parent, *kid, **hidden = NULL;
+    struct table_t *t = &node->tab;
+    struct stat st;
+    uint32_t k, e;
+    int i, ret, nhidden = 0, nquiet = 0, quiet = node->quiet;
+
+    if (table_open(t, parent ? parent->tab.dirfd : AT_FDCWD, node->name,
+                   &node->arena) != 0) {
+        node->err = errno;
+        node->errmsg = "ls: can not access %s";
+    }
+    if (parent != NULL) {
+        node_fd_release(parent);
+    }
+    t_stats.sys[SC_STAT] += node->err == 0;
+    if (node->err == 0 && fstat(t->dirfd, &st) == 0) {
+        node->dev = st.st_dev;
+        node->ino = st.st_ino;
+        if (node_is_cycle(node) || (!g_args.du && node_seen(node))) {
+            node->err = ELISTED;
+            node->errmsg = "ls: not listing already-listed directory %s";
+        } else {
+            node->du_blocks = st.st_blocks;
+            node->du_size = st.st_size;
+        }
+    }
+    if (node->err == 0) {
+        while ((ret = table_read(t)) > 0)
+            ;
+        if (ret == -1) {
+            node->err = errno;
+            node->errmsg = "ls: can not read %s";
+        }
+    }
+    if (node->err == 0) {
+        if (g_args.du) {
+            stat_range(t, 0, t->n);
+            hidden = arena_alloc(&w->scratch[id],
+                                 sizeof(struct node_t*) * t->n);
+            nhidden = du_scan(node, hidden);
+            table_filter(t);
+        } else {
+            table_filter(t);
+            stat_range(t, 0, t->n);
+            if (g_filter.ninclude > 0) {
+                table_filter(t); /* the DT_UNKNOWN ones that aren't dirs */
+            }
+        }
+        if (!g_args.unsorted && !node->quiet) {
+            sort(t, &w->scratch[id]);
+        }
+
+        /* printed children first, then those only walked for --du */
+        node->kids = arena_alloc(&node->arena,
+                                 sizeof(struct node_t*) * (t->n + nhidden));
+        for (k = 0; k < t->n && (g_args.recursive || g_args.du); k++) {
+            char *name;
+            e = t->order ? t->order[k] : k;
+            name = tname(t, e);
+            if (t->err[e] == 0 && S_ISDIR(t->mode[e]) &&
+                strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                kid = node_new(node, name);
+                if (g_args.du && !g_args.recursive) {
+                    kid->quiet = 1;
+                }
+                if (!node->quiet) {
+                    kid->slot = e;
+                }
+                if (kid->quiet) {
+                    hidden[nhidden++] = kid;
+                } else {
+                    node->kids[node->nkids++] = kid;
+                }
+            }
+        }
+        for (i = 0; i < nhidden; i++) {
+            node->kids[node->nkids + i] = hidden[i];
+        }
+        nquiet = nhidden;
+        __atomic_add_fetch(&node->refs, node->nkids + nquiet, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&node->fd_users, node->nkids + nquiet,
+                           __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&node->du_pending, node->nkids + nquiet,
+                           __ATOMIC_ACQ_REL);
+        for (i = node->nkids + nquiet - 1; i >= 0; i--) {
+            walker_push(w, id, node->kids[i]);
+        }
+        arena_reset(&w->scratch[id]);
+    }
+
+    if (parent == NULL) {
+        node->ahead_bytes = arena_size(&node->arena);
+        pthread_mutex_lock(&w->feed_lock);
+        w->ahead_done++;
+        w->ahead_bytes += node->ahead_bytes;
+        pthread_mutex_unlock(&w->feed_lock);
+    }
+    pthread_mutex_lock(&w->lock);
+    node->done = 1;
+    if (w->waiting == node) {
+        pthread_cond_signal(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    /* without --du the printer may have freed a printed node by now */
+    if (quiet) {
+        /* nobody prints it, the children have what they need */
+        arena_free(&node->arena);
+    }
+    if (quiet || g_args.du) {
+        /*
+         * --du prints a node only once its whole subtree is walked, the
+         * printer reopens it if it must read links rather than keeping
+         * every directory of the walk open until then
+         */
+        node_fd_release(node);
+    }
+    if (g_args.du) {
+        du_finish(w, node);
+    }
+    if (parent == NULL) {
+        walk_feed(w); /* after done, node may be freed by now */
+    }
+}
+
+static void* walker_main(void *arg) {
+    struct walker_arg_t *a = arg;
+    struct walker_t *w = a->w;
+    struct node_t *node;
+    int i, finished;
+
+    for (;;) {
+        node = deque_take(&w->deques[a->id], 0);
+        for (i = 1; node == NULL && i < w->nworkers; i++) {
+            node = deque_take(&w->deques[(a->id + i) % w->nworkers], 1);
+        }
+        if (node != NULL) {
+            __atomic_sub_fetch(&w->queued, 1, __ATOMIC_ACQ_REL);
+            walk_node(w, a->id, node);
+            if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&w->lock);
+                pthread_cond_broadcast(&w->work);
+                pthread_mutex_unlock(&w->lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&w->lock);
+        while (__atomic_load_n(&w->queued, __ATOMIC_ACQUIRE) == 0 &&
+               (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) > 0 ||
+                w->feeding)) {
+            w->idle++;
+            pthread_cond_wait(&w->work, &w->lock);
+            w->idle--;
+        }
+        finished = __atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0 &&
+                   !w->feeding;
+        pthread_mutex_unlock(&w->lock);
+        if (finished) break;
+    }
+    free(t_dents);
+#ifdef HAVE_IO_URING
+    uring_free(t_ring);
+#endif
+    stats_flush();
+    return NULL;
+}
+
+/* the --du total of a listing, in 1K blocks like du */
+static void pr_total(struct outbuf_t *out, uint64_t blocks) {
+    char buf[32];
+    int n, i = 0;
+
+    if (g_args.format != FMT_TEXT) return;
+    out_str(out, "total ");
+    if (g_args.human && blocks * 512 >= ONE_KB) {
+        n = fmt_human(buf, sizeof(buf), blocks * 512);
+        while (buf[i] == ' ') i++;
+        out_mem(out, buf + i, n - i);
+    } else {
+        out_num_left(out, (blocks + 1) / 2, 0);
+    }
+    out_eol(out);
+}
+
+/*
+ * Print node once its walker, and with --du its whole subtree, is done.
+ * Returns 0 when its children are not to be printed.
+ */
+static int walk_print(struct walker_t *w, struct node_t *node) {
+    struct table_t *t = &node->tab;
+    struct widths_t wd;
+    uint32_t i;
+
+    pthread_mutex_lock(&w->lock);
+    while (!(g_args.du ? node->du_done : node->done)) {
+        w->waiting = node;
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    w->waiting = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    if (node->stale) {
+        return 0;
+    }
+    if (node->err == 0 && g_args.skip_seen &&
+        !id_first(g_seen, node->dev, node->ino, 1)) {
+        node->err = ELISTED;
+        node->errmsg = "ls: not listing already-listed directory %s";
+    }
+    if (node->err == ELISTED) {
+        err_msg(node->errmsg, node->path); /* like GNU ls, no errno */
+    } else if (node->err != 0) {
+        errno = node->err;
+        err_sys(node->errmsg, node->path);
+    } else {
+        for (i = 0; g_args.du && i < t->n; i++) {
+            if (t->err[i] == 0 && S_ISLNK(t->mode[i])) {
+                /* its walker closed it, reopen it for the targets */
+                t->dirfd = openat(AT_FDCWD, node->path,
+                                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                t_stats.sys[SC_OPEN]++;
+                break;
+            }
+        }
+        pr_header(node->path);
+        if (g_args.du) {
+            pr_total(&g_out, node->du_blocks);
+            for (i = 0; i < t->n; i++) {
+                if (strcmp(tname(t, i), ".") == 0) t->size[i] = node->du_size;
+            }
+        }
+        widths_init(&wd);
+        print_range(&g_out, t, 0, head_count(t->n), &wd);
+        if (g_args.du) {
+            table_close(t);
+        }
+    }
+    return node->err == 0;
+}
+
+/* dirs are large trees often, don't run out of descriptors early */
+static void raise_nofile(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * -R listing of dirs, and the listing of several dirs without it. The
+ * walkers run ahead filling in nodes; the output is put back into depth
+ * first order here by printing each node's block before those of its
+ * children. The roots are handed out as printing gets close to them, so
+ * many arguments don't all sit in memory at once.
+ */
+static void walk(struct table_t *dirs) {
+    struct walker_t w;
+    struct walker_arg_t args[MAX_JOBS];
+    pthread_t tids[MAX_JOBS];
+    struct node_t **stack = NULL, *node;
+    int i, sp = 0, cap = 0, dc = dirs->n, listed;
+
+    raise_nofile();
+    memset(&w, 0, sizeof(w));
+    w.nworkers = job_count();
+    w.deques = calloc(w.nworkers, sizeof(struct deque_t));
+    w.scratch = calloc(w.nworkers, sizeof(struct arena_t));
+    if (w.deques == NULL || w.scratch == NULL) {
+        err_sys("ls: no memory");
+        exit(1);
+    }
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_mutex_init(&w.feed_lock, NULL);
+    pthread_cond_init(&w.work, NULL);
+    pthread_cond_init(&w.done, NULL);
+    for (i = 0; i < w.nworkers; i++) {
+        pthread_mutex_init(&w.deques[i].lock, NULL);
+        arena_init(&w.scratch[i], ARENA_BLOCK);
+    }
+    for (i = 0; i < ID_SHARDS; i++) {
+        pthread_mutex_init(&g_links[i].lock, NULL);
+        pthread_mutex_init(&g_seen[i].lock, NULL);
+    }
+
+    cap = dc > 64 ? dc : 64;
+    stack = xrealloc(NULL, sizeof(struct node_t*) * cap);
+    w.roots = xrealloc(NULL, sizeof(struct node_t*) * (dc + 1));
+    w.nroots = dc;
+    for (i = dc - 1; i >= 0; i--) {
+        node = node_new(NULL, tname(dirs, dirs->order ? dirs->order[i]
+                                                      : (uint32_t)i));
+        stack[sp++] = w.roots[i] = node;
+    }
+    w.feeding = 1;
+    walk_feed(&w);
+    for (i = 0; i < w.nworkers; i++) {
+        args[i].w = &w;
+        args[i].id = i;
+        if (pthread_create(&tids[i], NULL, walker_main, &args[i]) != 0) {
+            err_sys("ls: can not create thread");
+            exit(1);
+        }
+    }
+
+    while (sp > 0) {
+        node = stack[--sp];
+        listed = walk_print(&w, node);
+        if (node->parent == NULL) {
+            pthread_mutex_lock(&w.feed_lock);
+            w.ahead--;
+            w.ahead_done--;
+            w.ahead_bytes -= node->ahead_bytes;
+            pthread_mutex_unlock(&w.feed_lock);
+            walk_feed(&w);
+        }
+        if (sp + node->nkids > cap) {
+            cap = (sp + node->nkids) * 2;
+            stack = xrealloc(stack, sizeof(struct node_t*) * cap);
+        }
+        for (i = node->nkids - 1; i >= 0; i--) {
+            node->kids[i]->stale = !listed;
+            stack[sp++] = node->kids[i];
+        }
+        arena_free(&node->arena);
+        if (!g_args.du) {
+            node_fd_release(node); /* the children may still need the fd */
+        }
+        node_release(node);
+    }
+
+    for (i = 0; i < w.nworkers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    for (i = 0; i < w.nworkers; i++) {
+        pthread_mutex_destroy(&w.deques[i].lock);
+        free(w.deques[i].items);
+        arena_free(&w.scratch[i]);
+    }
+    for (i = 0; i < ID_SHARDS; i++) {
+        pthread_mutex_destroy(&g_links[i].lock);
+        free(g_links[i].keys);
+        pthread_mutex_destroy(&g_seen[i].lock);
+        free(g_seen[i].keys);
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_mutex_destroy(&w.feed_lock);
+    pthread_cond_destroy(&w.work);
+    pthread_cond_destroy(&w.done);
+    free(w.deques);
+    free(w.scratch);
+    free(stack);
+    free(w.roots);
+}
+
+/*
+ * The --head candidates of a sorted listing: a table of at most
+ * g_args.head entries and a heap of its indices whose root is the one
+ * printed last, so a new entry has only to beat the root to get in.
+ */
+struct topk_t {
+    struct table_t t;
+    uint32_t *heap; /* indices of t */
+    uint64_t *seq; /* position in the directory of each entry of t */
+};
+
+/*
+ * Whether entry i of a at position sa is printed before entry j of b at
+ * position sb, the order sort() produces.
+ */
+static int topk_before(struct table_t *a, uint32_t i, uint64_t sa,
+                       struct table_t *b, uint32_t j, uint64_t sb) {
+    uint64_t ka, kb;
+    int r = 0;
+
+    if (g_args.sortkey != SORT_NAME) {
+        ka = sort_key(a, i);
+        kb = sort_key(b, j);
+        if (ka != kb) r = ka > kb ? -1 : 1;
+    }
+    if (r == 0) r = strcasecmp(tname(a, i), tname(b, j));
+    if (r == 0) r = sa < sb ? -1 : 1;
+    return g_args.reverse ? r > 0 : r < 0;
+}
+
+static void topk_down(struct topk_t *h, uint32_t n, uint32_t k) {
+    uint32_t c, x = h->heap[k];
+
+    while ((c = 2 * k + 1) < n) {
+        if (c + 1 < n && topk_before(&h->t, h->heap[c], h->seq[h->heap[c]],
+                                     &h->t, h->heap[c+1],
+                                     h->seq[h->heap[c+1]])) {
+            c++;
+        }
+        if (!topk_before(&h->t, x, h->seq[x], &h->t, h->heap[c],
+                         h->seq[h->heap[c]])) {
+            break;
+        }
+        h->heap[k] = h->heap[c];
+        k = c;
+    }
+    h->heap[k] = x;
+}
+
+/* copy entry i of src into slot j of h->t */
+static void topk_set(struct topk_t *h, uint32_t j, struct table_t *src,
+                     uint32_t i, uint64_t seq) {
+    struct table_t *t = &h->t;
+
+    memcpy(tname(t, j), tname(src, i), src->len[i] + 1);
+    t->len[j] = src->len[i];
+    t->type[j] = src->type[i];
+    t->ino[j] = src->ino[i];
+    table_copy_stat(t, j, src, i);
+    h->seq[j] = seq;
+}
+
+/* offer stat'ed entry i of src to h */
+static void topk_add(struct topk_t *h, struct table_t *src, uint32_t i,
+                     uint64_t seq) {
+    struct table_t *t = &h->t;
+    uint32_t j, k, p;
+
+    if (t->n < g_args.head) {
+        /* slots hold any name, an entry that gets in later may reuse it */
+        table_grow(t, NAME_MAX + 1);
+        if (t->err == NULL) {
+            table_stat_init(t);
+        }
+        j = t->n++;
+        t->name[j] = t->pool_used;
+        t->pool_used += NAME_MAX + 1;
+        if ((j & (j + 1)) == 0) {
+            h->heap = xrealloc(h->heap, sizeof(uint32_t) * (2 * j + 1));
+            h->seq = xrealloc(h->seq, sizeof(uint64_t) * (2 * j + 1));
+        }
+        topk_set(h, j, src, i, seq);
+        for (k = j; k > 0; k = p) {
+            p = (k - 1) / 2;
+            if (!topk_before(t, h->heap[p], h->seq[h->heap[p]],
+                             t, j, seq)) {
+                break;
+            }
+            h->heap[k] = h->heap[p];
+        }
+        h->heap[k] = j;
+        return;
+    }
+    j = h->heap[0];
+    if (topk_before(src, i, seq, t, j, h->seq[j])) {
+        topk_set(h, j, src, i, seq);
+        topk_down(h, t->n, 0);
+    }
+}
+
+/*
+ * Sorted listing of dir with --head: each getdents64 batch is stat'ed and
+ * offered to a heap of the best g_args.head entries, then thrown away, so
+ * memory is O(head) however big dir is. Popping the heap leaves the
+ * entries in output order.
+ */
+static void head_dir(char *dir) {
+    struct arena_t keep;
+    struct topk_t h;
+    struct table_t t;
+    struct widths_t w;
+    uint64_t seq = 0;
+    uint32_t i, n;
+    int ret;
+
+    if (table_open(&t, AT_FDCWD, dir, &g_arena) != 0) {
+        err_sys("ls: can not access %s", dir);
+        return;
+    }
+    arena_init(&keep, ARENA_BLOCK);
+    table_init(&h.t, &keep, t.dirfd);
+    h.heap = NULL;
+    h.seq = NULL;
+    while ((ret = table_read(&t)) > 0) {
+        table_filter(&t);
+        stat_range(&t, 0, t.n);
+        for (i = 0; i < t.n; i++) {
+            topk_add(&h, &t, i, seq++);
+        }
+        table_reset(&t);
+    }
+    if (ret == -1) {
+        err_sys("ls: can not read %s", dir);
+    } else {
+        n = h.t.n;
+        h.t.order = arena_alloc(&keep, sizeof(uint32_t) * n);
+        for (i = n; i > 0; i--) {
+            h.t.order[i-1] = h.heap[0];
+            h.heap[0] = h.heap[i-1];
+            topk_down(&h, i - 1, 0);
+        }
+        pr_header(dir);
+        widths_init(&w);
+        print_range(&g_out, &h.t, 0, n, &w);
+    }
+    table_close(&t);
+    arena_reset(&g_arena);
+    arena_free(&keep);
+    free(h.heap);
+    free(h.seq);
+}
+
+/* the options that decide which entries a table holds and what is in it */
+static uint32_t cache_flags(void) {
+    return g_args.all | g_args.almost << 1 | g_args.follow << 2 |
+           g_args.sortkey << 3 | g_args.reverse << 5 | g_args.shortfmt << 6 |
+           g_args.classify << 7 | (g_args.format != FMT_TEXT) << 9;
+}
+
+/*
+ * Whether the listing shows only what changing a file can't hide from
+ * its directory's mtime and ctime, the names and types, so a --cache
+ * file is never out of date.
+ */
+static int cache_usable(void) {
+    return !need_stat(DT_REG) && !need_stat(DT_DIR) && !need_stat(DT_LNK);
+}
+
+static int cache_path(char *buf, size_t len, struct stat *st) {
+    int n = snprintf(buf, len, "%s/%llx-%llx-%x", g_args.cache,
+                     (unsigned long long)st->st_dev,
+                     (unsigned long long)st->st_ino, cache_flags());
+    return n > 0 && (size_t)n < len ? 0 : -1;
+}
+
+/* element size of the cache file arrays, in the order of cache_arrays() */
+static const size_t cache_elem[CACHE_ARRAYS] = {
+    sizeof(uint32_t), sizeof(uint32_t), sizeof(int), sizeof(uint32_t),
+    sizeof(uint16_t)
+};
+
+/*
+ * The arrays of t pr_short() needs, and its names last, as they follow
+ * the cache header. The mode only has to hold the file type.
+ */
+static void cache_arrays(struct table_t *t, void **a[CACHE_ARRAYS + 1]) {
+    a[0] = (void**)&t->name; a[1] = (void**)&t->mode;
+    a[2] = (void**)&t->err; a[3] = (void**)&t->order;
+    a[4] = (void**)&t->len; a[5] = (void**)&t->names;
+}
+
+/* file offsets of the arrays of an n entry table, then of the names */
+static size_t cache_layout(uint64_t n, size_t off[CACHE_ARRAYS + 1],
+                           uint64_t pool) {
+    size_t pos = sizeof(struct cache_hdr_t);
+    int k;
 
-    va_start(ap, fmt);
-    vsnprintf(buf, MAXLINE, fmt, ap);
-    snprintf(buf+strlen(buf), MAXLINE-strlen(buf), ": %s", strerror(errno));
-    strcat(buf, "\n");
-    fflush(stdout); /* in case stdout and stderr are the same */
-    fputs(buf, stderr);
-    fflush(NULL);
-    va_end(ap);
+    for (k = 0; k < CACHE_ARRAYS; k++) {
+        off[k] = pos;
+        pos = (pos + cache_elem[k] * n + 7) & ~(size_t)7;
+    }
+    off[CACHE_ARRAYS] = pos;
+    return pos + pool;
 }
 
-static int cmp(const void *pa, const void *pb) {
-    char *s1 = *(char**)pa;
-    char *s2 = *(char**)pb;
-    return strcasecmp(s1, s2);
-}
+/* whether the offsets in a mapped table stay inside the file */
+static int cache_check(struct table_t *t, uint64_t pool) {
+    uint32_t i;
 
-static void sort(char **files, int n) {
-    qsort(files, n, sizeof(char*), cmp);
+    if (pool == 0 || t->names[pool-1] != '\0') return 0;
+    for (i = 0; i < t->n; i++) {
+        if (t->order[i] >= t->n || (uint64_t)t->name[i] + t->len[i] >= pool ||
+            t->names[t->name[i] + t->len[i]] != '\0') {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-static int parse_args(int argc, char **argv) {
-    int opt, index;
-    static char* DEFAULT_FILES[] = {"."};
+/*
+ * Print dir from its --cache file if there is one and the directory has
+ * not changed since. Returns 0 if it did, -1 to list dir the usual way.
+ */
+static int cache_print(char *dir) {
+    char path[PATH_MAX];
+    struct cache_hdr_t *h;
+    struct widths_t w;
+    struct table_t t;
+    struct stat st, fst;
+    size_t off[CACHE_ARRAYS + 1];
+    void **a[CACHE_ARRAYS + 1];
+    char *map;
+    int fd, k, ok;
 
-    for (;;) {
-        opt = getopt_long(argc, argv, opts, options, &index);
-        if (opt == -1) break;
-        switch (opt) {
-            case 'a':
-                g_args.all = 1;
-                break;
-            case 'A':
-                g_args.almost = 1;
-                break;
-            case 'h':
-                g_args.human = 1;
-                break;
-            case 'L':
-                g_args.follow = 1;
-                break;
-            case '?':
-            default:
-                return -1;
+    t_stats.sys[SC_STAT]++;
+    if (stat(dir, &st) != 0 || cache_path(path, sizeof(path), &st) != 0) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    t_stats.sys[SC_OPEN]++;
+    if (fd == -1) {
+        return -1;
+    }
+    t_stats.sys[SC_STAT]++;
+    if (fstat(fd, &fst) != 0 || fst.st_size < (off_t)sizeof(*h) ||
+        (map = mmap(NULL, fst.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+        MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    h = (struct cache_hdr_t*)map;
+    ok = memcmp(h->magic, CACHE_MAGIC, 8) == 0 && h->flags == cache_flags() &&
+         h->dev == (uint64_t)st.st_dev && h->ino == (uint64_t)st.st_ino &&
+         h->mtime == st.st_mtim.tv_sec && h->mtime_nsec == st.st_mtim.tv_nsec &&
+         h->ctime == st.st_ctim.tv_sec && h->ctime_nsec == st.st_ctim.tv_nsec &&
+         h->pool <= UINT32_MAX &&
+         cache_layout(h->n, off, h->pool) == (size_t)fst.st_size;
+    if (ok) {
+        memset(&t, 0, sizeof(t));
+        t.dirfd = -1;
+        t.n = h->n;
+        cache_arrays(&t, a);
+        for (k = 0; k <= CACHE_ARRAYS; k++) {
+            *a[k] = map + off[k];
         }
+        ok = cache_check(&t, h->pool);
     }
-    
-    /* only one of two */
-    if (g_args.almost && g_args.all) {
-        g_args.almost = 0;
+    if (ok) {
+        pr_header(dir);
+        widths_init(&w);
+        print_range(&g_out, &t, 0, head_count(t.n), &w);
     }
+    munmap(map, fst.st_size);
+    return ok ? 0 : -1;
+}
 
-    g_args.files = argv + optind;
-    g_args.fc = argc - optind;
-    if (g_args.fc == 0) {
-        g_args.files = DEFAULT_FILES;
-        g_args.fc = 1;
-    }
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t n;
 
+    while (len > 0) {
+        n = write(fd, p, len);
+        t_stats.sys[SC_WRITE]++;
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
     return 0;
 }
 
-#ifdef DEBUG
-static void dump_opts(void) {
-    int i;
-    fprintf(stdout, "--dumping options--\n");
-    if (g_args.all) {
-        fprintf(stdout, "--all ");
+/*
+ * Save the sorted table of dir to its --cache file. Best effort: any
+ * failure just leaves no cache file behind.
+ */
+static void cache_save(struct table_t *t) {
+    static const char zeros[8];
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    struct cache_hdr_t h;
+    struct stat st;
+    size_t off[CACHE_ARRAYS + 1], len;
+    void **a[CACHE_ARRAYS + 1];
+    int fd, k, ok;
+
+    t_stats.sys[SC_STAT] += t->n != 0;
+    if (t->n == 0 || fstat(t->dirfd, &st) != 0 ||
+        cache_path(path, sizeof(path), &st) != 0) {
+        return;
     }
-    if (g_args.almost) {
-        fprintf(stdout, "--almost-all ");
+    /* a change within the same clock tick would go unnoticed */
+    if (st.st_ctime >= time(NULL) - 1) {
+        return;
     }
-    if (g_args.human) {
-        fprintf(stdout, "--human-readable ");
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, 8);
+    h.flags = cache_flags();
+    h.n = t->n;
+    h.dev = st.st_dev;
+    h.ino = st.st_ino;
+    h.mtime = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.ctime = st.st_ctim.tv_sec;
+    h.ctime_nsec = st.st_ctim.tv_nsec;
+    h.pool = t->pool_used;
+    cache_layout(t->n, off, t->pool_used);
+    cache_arrays(t, a);
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    t_stats.sys[SC_OPEN]++;
+    if (fd != -1) {
+        ok = write_all(fd, &h, sizeof(h)) == 0;
+        for (k = 0; ok && k < CACHE_ARRAYS; k++) {
+            len = cache_elem[k] * t->n;
+            ok = write_all(fd, *a[k], len) == 0 &&
+                 write_all(fd, zeros, off[k+1] - off[k] - len) == 0;
+        }
+        ok = ok && write_all(fd, t->names, t->pool_used) == 0;
+        if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+            unlink(tmp);
+        }
     }
-    if (g_args.follow) {
-        fprintf(stdout, "--dereference");
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
     }
-    fprintf(stdout, "\nfiles to process:\n");
+    return h;
+}
 
-    for (i = 0; i < g_args.fc; i++) {
-        fprintf(stdout, "%s\n", g_args.files[i]);
+/* the names slot of name, or of the empty slot it would go to */
+static uint32_t watch_slot(struct watch_t *wt, const char *name) {
+    uint32_t mask = wt->size - 1, i, e, gone = WATCH_GONE;
+
+    for (i = name_hash(name) & mask; (e = wt->names[i]) != 0;
+         i = (i + 1) & mask) {
+        if (e == WATCH_GONE) {
+            if (gone == WATCH_GONE) gone = i;
+        } else if (strcmp(tname(&wt->t, e - 1), name) == 0) {
+            return i;
+        }
     }
-    fprintf(stdout, "--end options--\n");
+    return gone != WATCH_GONE ? gone : i;
 }
-#endif
 
-static int isdir(const char *path) {
-    struct stat buf;
-    int ret = stat(path, &buf);
-    return ret == 0 && S_ISDIR(buf.st_mode);
+static void watch_hash(struct watch_t *wt, uint32_t e) {
+    uint32_t *old = wt->names, size = wt->size, i, j;
+
+    if (2 * (wt->used + 1) > wt->size) {
+        while (2 * (wt->nnames + 1) > wt->size / 2) {
+            wt->size = wt->size ? wt->size * 2 : 64;
+        }
+        wt->names = calloc(wt->size, sizeof(uint32_t));
+        if (wt->names == NULL) {
+            err_sys("ls: no memory");
+            exit(1);
+        }
+        wt->used = 0;
+        for (i = 0; i < size; i++) {
+            if (old[i] != 0 && old[i] != WATCH_GONE) {
+                j = watch_slot(wt, tname(&wt->t, old[i] - 1));
+                wt->names[j] = old[i];
+                wt->used++;
+            }
+        }
+        free(old);
+    }
+    i = watch_slot(wt, tname(&wt->t, e));
+    if (wt->names[i] == 0) wt->used++;
+    wt->names[i] = e + 1;
+    wt->nnames++;
+}
+
+/* the table entry of name, -1 if it is not listed */
+static int64_t watch_find(struct watch_t *wt, const char *name) {
+    uint32_t e;
+
+    if (wt->size == 0) return -1;
+    e = wt->names[watch_slot(wt, name)];
+    return e == 0 || e == WATCH_GONE ? -1 : (int64_t)e - 1;
+}
+
+/* the order sort() puts entries a and b of t in */
+static int watch_cmp(struct table_t *t, uint32_t a, uint32_t b) {
+    uint64_t ka, kb;
+    int r = 0;
+
+    if (g_args.sortkey != SORT_NAME) {
+        ka = sort_key(t, a);
+        kb = sort_key(t, b);
+        if (ka != kb) r = ka > kb ? -1 : 1;
+    }
+    if (r == 0) r = strcasecmp(tname(t, a), tname(t, b));
+    if (r == 0) r = a < b ? -1 : a > b;
+    return g_args.reverse ? -r : r;
 }
 
-static void classify(char **dirs, int *dc, char **files, int *fc) {
-    int i, di, fi;
+/* where entry e is or would go in wt->idx */
+static uint32_t watch_pos(struct watch_t *wt, uint32_t e) {
+    uint32_t lo = 0, hi = wt->nidx, mid;
 
-    for (i = di = fi = 0; i < g_args.fc; i++) {
-        if (isdir(g_args.files[i])) {
-            dirs[di++] = g_args.files[i];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (watch_cmp(&wt->t, wt->idx[mid], e) < 0) {
+            lo = mid + 1;
         } else {
-            files[fi++] = g_args.files[i];
+            hi = mid;
         }
     }
-    *dc = di;
-    *fc = fi;
+    return lo;
 }
 
-static int get_stat(char *path, struct stat *buf) {
-    if (g_args.follow) {
-        return stat(path, buf);
+static void watch_insert(struct watch_t *wt, uint32_t e) {
+    uint32_t pos = watch_pos(wt, e);
+
+    if (wt->nidx == wt->cap) {
+        wt->cap = wt->cap ? wt->cap * 2 : 64;
+        wt->idx = xrealloc(wt->idx, sizeof(uint32_t) * wt->cap);
     }
-    return lstat(path, buf);
+    memmove(wt->idx + pos + 1, wt->idx + pos,
+            sizeof(uint32_t) * (wt->nidx - pos));
+    wt->idx[pos] = e;
+    wt->nidx++;
 }
 
-static char* fmt_mode(mode_t mode) {
-    static char ms[11];
-    enum {
-        TYPE,
-        UR, UW, UX,
-        GR, GW, GX,
-        OR, OW, OX
-    };
+static void watch_remove(struct watch_t *wt, uint32_t e) {
+    uint32_t pos = watch_pos(wt, e);
 
-    strcpy(ms, DEFAULT_PERM);
-    if (S_ISDIR(mode))  ms[TYPE] = 'd';
-    else if (S_ISLNK(mode))  ms[TYPE] = 'l';
-    else if (S_ISCHR(mode)) ms[TYPE] = 'c';
-    else if (S_ISBLK(mode)) ms[TYPE] = 'b';
-    else if (S_ISFIFO(mode)) ms[TYPE] = 'p';
-    else if (S_ISSOCK(mode)) ms[TYPE] = 's';
+    memmove(wt->idx + pos, wt->idx + pos + 1,
+            sizeof(uint32_t) * (wt->nidx - pos - 1));
+    wt->nidx--;
+}
 
-    if ((S_IRUSR & mode) == S_IRUSR) ms[UR] = 'r';
-    if ((S_IWUSR & mode) == S_IWUSR) ms[UW] = 'w';
-    if ((S_IXUSR & mode) == S_IXUSR) ms[UX] = 'x';
-    if ((S_IRGRP & mode) == S_IRGRP) ms[GR] = 'r';
-    if ((S_IWGRP & mode) == S_IWGRP) ms[GW] = 'w';
-    if ((S_IXGRP & mode) == S_IXGRP) ms[GX] = 'x';
-    if ((S_IROTH & mode) == S_IROTH) ms[OR] = 'r';
-    if ((S_IWOTH & mode) == S_IWOTH) ms[OW] = 'w';
-    if ((S_IXOTH & mode) == S_IXOTH) ms[OX] = 'x';
-    return ms;
+/* one line of changes, c is '+', '-' or '~' */
+static void watch_line(struct watch_t *wt, uint32_t e, char c) {
+    struct table_t *t = &wt->t;
+
+    if (c != '-' && t->err[e] != 0) {
+        errno = t->err[e];
+        err_sys("ls: can not access %s", tname(t, e));
+        return;
+    }
+    out_char(&g_out, c);
+    out_char(&g_out, ' ');
+    if (c == '-') {
+        out_mem(&g_out, tname(t, e), t->len[e]);
+        out_eol(&g_out);
+    } else {
+        print_range(&g_out, t, e, e + 1, &wt->w);
+    }
 }
 
-static char* fmt_owner(uid_t uid) {
-    struct passwd *pwd = getpwuid(uid);
-    return (pwd == NULL) ? "" : pwd->pw_name;
+/*
+ * Read, stat and sort the directory open in wt->t.dirfd into wt and
+ * print it in full. Returns -1 if it can't be read.
+ */
+static int watch_load(struct watch_t *wt, char *dir) {
+    struct table_t *t = &wt->t;
+    uint32_t i;
+    int fd = t->dirfd, ret;
+
+    arena_reset(t->arena);
+    table_init(t, &wt->arena[wt->cur], fd);
+    lseek(fd, 0, SEEK_SET);
+    while ((ret = table_read(t)) > 0)
+        ;
+    if (ret == -1) {
+        err_sys("ls: can not read %s", dir);
+        return -1;
+    }
+    table_filter(t);
+    stat_range(t, 0, t->n);
+    if (t->err == NULL) {
+        /* empty, entries added later need the stat arrays */
+        table_grow(t, 0);
+        table_stat_init(t);
+    }
+    free(wt->names);
+    wt->names = NULL;
+    wt->nnames = wt->size = wt->used = wt->dead = 0;
+    wt->nidx = 0;
+    for (i = 0; i < t->n; i++) {
+        watch_insert(wt, i);
+        watch_hash(wt, i);
+    }
+    widths_init(&wt->w);
+    t->order = wt->idx;
+    print_range(&g_out, t, 0, wt->nidx, &wt->w);
+    t->order = NULL;
+    return 0;
 }
 
-static char* fmt_group(gid_t gid) {
-    struct group *grp = getgrgid(gid);
-    return (grp == NULL) ? "" : grp->gr_name;
+/*
+ * Copy the entries still listed into a fresh table in the other arena,
+ * so a directory with a lot of churn doesn't grow the table for ever.
+ */
+static void watch_compact(struct watch_t *wt) {
+    struct table_t *t = &wt->t, nt;
+    uint32_t k, i;
+
+    arena_reset(&wt->arena[!wt->cur]);
+    table_init(&nt, &wt->arena[!wt->cur], t->dirfd);
+    table_grow(&nt, 0);
+    table_stat_init(&nt);
+    for (k = 0; k < wt->nidx; k++) {
+        i = wt->idx[k];
+        table_add(&nt, tname(t, i), t->len[i], t->type[i], t->ino[i]);
+        table_copy_stat(&nt, k, t, i);
+    }
+    arena_reset(&wt->arena[wt->cur]);
+    wt->cur = !wt->cur;
+    *t = nt;
+    free(wt->names);
+    wt->names = NULL;
+    wt->nnames = wt->size = wt->used = wt->dead = 0;
+    /* same order, now of entries 0..nidx-1 */
+    for (k = 0; k < wt->nidx; k++) {
+        wt->idx[k] = k;
+        watch_hash(wt, k);
+    }
 }
 
-static char* fmt_time(time_t *time) {
-    static char buf[64];
-    struct tm *t = localtime(time);
-    strftime(buf, sizeof(buf), "%F %H:%M", t);
-    return buf;
+/* a new or replaced entry name, stat'ed and put into place */
+static void watch_add(struct watch_t *wt, const char *name) {
+    struct table_t *t = &wt->t;
+    int64_t e = watch_find(wt, name);
+    uint32_t i;
+
+    if (e >= 0) {
+        /* replaced by a rename, take the new one's place */
+        watch_remove(wt, e);
+        t->err[e] = get_stat(t, e) == 0 ? 0 : errno;
+        watch_insert(wt, e);
+        watch_line(wt, e, '~');
+        return;
+    }
+    table_add(t, name, strlen(name), DT_UNKNOWN, 0);
+    i = t->n - 1;
+    t->err[i] = get_stat(t, i) == 0 ? 0 : errno;
+    if (t->err[i] == ENOENT) {
+        wt->dead++; /* gone again already */
+        return;
+    }
+    watch_insert(wt, i);
+    watch_hash(wt, i);
+    watch_line(wt, i, '+');
 }
 
-static char* fmt_name(struct stat *st, char *name) {
-    char *buf;
+static void watch_del(struct watch_t *wt, const char *name) {
+    int64_t e = watch_find(wt, name);
 
-    if (S_ISLNK(st->st_mode)) {
-        ssize_t len;
-        int offset;
+    if (e < 0) return;
+    watch_remove(wt, e);
+    wt->names[watch_slot(wt, name)] = WATCH_GONE;
+    wt->nnames--;
+    wt->dead++;
+    watch_line(wt, e, '-');
+}
 
-        buf = malloc(4096);
-        if (buf == NULL) {
-            err_sys("ls: no memory");
-            exit(1);
-        }
-        offset = snprintf(buf, 4096, "%s -> ", name);
-        len = readlink(name, buf+offset, 4096-offset);
-        if (len == -1) {
-            err_sys("ls: can not read link %s", name);
-            exit(1);
+/* new stat data for entry e, which may move it under -t and -S */
+static void watch_mod(struct watch_t *wt, uint32_t e) {
+    struct table_t *t = &wt->t;
+    uint64_t ino = t->ino[e];
+    uint32_t nlink = t->nlink[e], mode = t->mode[e];
+    uint32_t uid = t->uid[e], gid = t->gid[e];
+    int64_t size = t->size[e], mtime = t->mtime[e];
+    uint32_t mtime_ns = t->mtime_ns[e];
+
+    if (g_args.sortkey != SORT_NAME) {
+        watch_remove(wt, e);
+    }
+    t->err[e] = get_stat(t, e) == 0 ? 0 : errno;
+    if (t->err[e] == ENOENT) {
+        /* the delete event is on its way */
+        if (g_args.sortkey != SORT_NAME) {
+            t->err[e] = 0;
+            watch_insert(wt, e);
         }
-        buf[offset+len] = '\0';
-    } else {
-        buf = strdup(name);
+        return;
     }
-    return buf;
+    if (g_args.sortkey != SORT_NAME) {
+        watch_insert(wt, e);
+    }
+    if (t->err[e] == 0 && t->ino[e] == ino && t->nlink[e] == nlink &&
+        t->mode[e] == mode && t->uid[e] == uid && t->gid[e] == gid &&
+        t->size[e] == size && t->mtime[e] == mtime &&
+        t->mtime_ns[e] == mtime_ns) {
+        return; /* nothing that shows in the listing */
+    }
+    watch_line(wt, e, '~');
+}
+
+static int u32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
 }
 
-static char* fmt_size(off_t size) {
-    static char buf[32];
+/*
+ * --watch: list dir once, then follow its inotify events, applying each
+ * to the table and the ordered index in place and printing just the
+ * entries that changed. Work is in proportion to the changes; only an
+ * event queue overflow reads the directory again.
+ */
+static void watch(char *dir) {
+    char buf[64 * ONE_KB] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct watch_t wt;
+    uint32_t *dirty = NULL, ndirty, cap = 0, i, j, first;
+    int64_t e;
+    ssize_t len;
+    char *p;
+    int fd;
 
-    snprintf(buf, sizeof(buf), "%7ld", size);
-    if (g_args.human == 0) {
-        return buf;
+    memset(&wt, 0, sizeof(wt));
+    arena_init(&wt.arena[0], ARENA_BLOCK);
+    arena_init(&wt.arena[1], ARENA_BLOCK);
+    /* watch first, so nothing between reading and watching goes missing */
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1 || inotify_add_watch(fd, dir, WATCH_EVENTS | IN_ONLYDIR) == -1) {
+        err_sys("ls: can not watch %s", dir);
+        if (fd != -1) close(fd);
+        return;
+    }
+    if (table_open(&wt.t, AT_FDCWD, dir, &wt.arena[0]) != 0) {
+        err_sys("ls: can not access %s", dir);
+        close(fd);
+        return;
+    }
+    if (watch_load(&wt, dir) != 0) {
+        goto done;
+    }
+    for (;;) {
+        /*
+         * An open fd would keep a removed directory around and hold back
+         * IN_DELETE_SELF, so it is only open while events are handled.
+         */
+        table_close(&wt.t);
+        out_flush(&g_out);
+        len = read(fd, buf, sizeof(buf));
+        t_stats.sys[SC_INOTIFY]++;
+        if (len == -1 && errno == EINTR) continue;
+        if (len <= 0) {
+            err_sys("ls: can not watch %s", dir);
+            break;
+        }
+        wt.t.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        t_stats.sys[SC_OPEN]++;
+        if (wt.t.dirfd == -1) {
+            err_sys("ls: stopped watching %s", dir);
+            break;
+        }
+        /* stat changed entries once per batch, after the adds and deletes */
+        ndirty = 0;
+        first = wt.t.n;
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                out_char(&g_out, '\n');
+                out_eol(&g_out);
+                if (watch_load(&wt, dir) != 0) goto done;
+                ndirty = 0;
+                first = wt.t.n;
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                errno = ENOENT;
+                err_sys("ls: stopped watching %s", dir);
+                goto done;
+            }
+            if (ev->len == 0 || skip(ev->name) ||
+                name_filtered(ev->name, strlen(ev->name), DT_UNKNOWN)) {
+                continue;
+            }
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                watch_add(&wt, ev->name);
+            } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                watch_del(&wt, ev->name);
+            } else if ((e = watch_find(&wt, ev->name)) >= 0 && e < first) {
+                if (ndirty == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    dirty = xrealloc(dirty, sizeof(uint32_t) * cap);
+                }
+                dirty[ndirty++] = e;
+            }
+        }
+        /* a file being written sends many events, stat it once */
+        if (ndirty > 1) {
+            qsort(dirty, ndirty, sizeof(uint32_t), u32_cmp);
+        }
+        for (i = 0; i < ndirty; i = j) {
+            for (j = i + 1; j < ndirty && dirty[j] == dirty[i]; j++)
+                ;
+            if (watch_find(&wt, tname(&wt.t, dirty[i])) == (int64_t)dirty[i]) {
+                watch_mod(&wt, dirty[i]);
+            }
+        }
+        if (wt.dead > wt.nidx + 4096) {
+            watch_compact(&wt);
+        }
     }
+done:
+    out_flush(&g_out);
+    close(fd);
+    table_close(&wt.t);
+    free(wt.idx);
+    free(wt.names);
+    free(dirty);
+    arena_free(&wt.arena[0]);
+    arena_free(&wt.arena[1]);
+}
 
-    if (size >= ONE_GB) {
-        snprintf(buf, sizeof(buf), "%6.1fG", size / (double)ONE_GB);
-    } else if (size >= ONE_MB) {
-        snprintf(buf, sizeof(buf), "%6.1fM", size / (double)ONE_MB);
-    } else if (size >= ONE_KB) {
-        snprintf(buf, sizeof(buf), "%6.1fK", size / (double)ONE_KB);
+/*
+ * --max-memory: a sorted listing that outgrows the budget is sorted in
+ * runs instead. Each run is written in sort() order to an unlinked
+ * temporary file as --format=binary records, runs that pile up are merged
+ * ways at a time into longer ones, and the last merge prints as it reads.
+ * Memory stays at about one run plus a read buffer per merged file.
+ */
+
+static int run_create(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    int fd;
+
+    if (dir == NULL || *dir == '\0') {
+        dir = "/tmp";
     }
-    return buf;
+    snprintf(path, sizeof(path), "%s/ls-run.XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    t_stats.sys[SC_OPEN]++;
+    if (fd == -1) {
+        err_sys("ls: can not create a temporary file in %s", dir);
+        exit(1);
+    }
+    unlink(path);
+    return fd;
 }
 
-static void pr_line(struct stat *buf, char *name) {
-    char *fname;
+/* move r->rec on to the next record of the run, NULL at its end */
+static void run_next(struct run_t *r) {
+    size_t left;
+    ssize_t n;
+
+    if (r->rec != NULL) {
+        r->pos += r->rec->len;
+    }
+    for (;;) {
+        left = r->len - r->pos;
+        if (left >= sizeof(struct bin_rec_t) &&
+            left >= ((struct bin_rec_t*)(r->buf + r->pos))->len) {
+            r->rec = (struct bin_rec_t*)(r->buf + r->pos);
+            return;
+        }
+        memmove(r->buf, r->buf + r->pos, left);
+        r->pos = 0;
+        r->len = left;
+        n = read(r->fd, r->buf + left, RUN_BUFSIZE - left);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            err_sys("ls: can not read a temporary file");
+            exit(1);
+        }
+        if (n == 0) {
+            r->rec = NULL;
+            return;
+        }
+        r->len += n;
+    }
+}
 
-    fprintf(stdout, "%-6ld ", buf->st_ino);
-    fprintf(stdout, "%-2d ", buf->st_nlink);
-    fprintf(stdout, "%s ", fmt_mode(buf->st_mode));
-    fprintf(stdout, "%-8s ", fmt_owner(buf->st_uid));
-    fprintf(stdout, "%-8s ", fmt_group(buf->st_gid));
-    fprintf(stdout, "%s ", fmt_size(buf->st_size));
-    fprintf(stdout, "%s ", fmt_time(&buf->st_mtime));
-    fname = fmt_name(buf, name);
-    fprintf(stdout, "%-s", fname);
-    free(fname);
-    fprintf(stdout, "\n");
+/* sort_key() of a run record */
+static uint64_t run_key(const struct bin_rec_t *r) {
+    if (r->err != 0) return 0;
+    if (g_args.sortkey == SORT_TIME) {
+        return (uint64_t)r->mtime ^ (1ULL << 63);
+    }
+    return (uint64_t)r->size;
 }
 
-static int skip(char *file) {
-    if (g_args.all) {
-        return 0;
+/*
+ * The sort() order of the current records of runs a and b, < 0 if a's
+ * goes first. Runs are kept in reading order, so on ties the earlier run
+ * holds the earlier entry.
+ */
+static int run_cmp(const struct run_t *a, const struct run_t *b) {
+    const struct bin_rec_t *x = a->rec, *y = b->rec;
+    uint64_t kx, ky;
+    int r = 0;
+
+    if (g_args.sortkey != SORT_NAME) {
+        kx = run_key(x);
+        ky = run_key(y);
+        r = (kx < ky) - (kx > ky);
     }
-    if (g_args.almost && 
-        (strcmp(file, ".") != 0 && strcmp(file, "..") != 0)) {
-        return 0;
+    if (r == 0) {
+        r = strncasecmp((const char*)(x + 1), (const char*)(y + 1),
+                        x->name_len < y->name_len ? x->name_len : y->name_len);
     }
-    if (file[0] == '.') {
-        return 1;
+    if (r == 0) {
+        r = (x->name_len > y->name_len) - (x->name_len < y->name_len);
     }
-    return 0;
+    if (r == 0) {
+        r = a < b ? -1 : 1;
+    }
+    return g_args.reverse ? -r : r;
 }
 
-static void do_files(char **files, int fc) {
-    int i;
-    struct stat buf;
+static void run_down(struct run_t **heap, int n, int i) {
+    struct run_t *cur = heap[i];
+    int c;
+
+    while ((c = 2 * i + 1) < n) {
+        if (c + 1 < n && run_cmp(heap[c+1], heap[c]) < 0) c++;
+        if (run_cmp(cur, heap[c]) <= 0) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = cur;
+}
+
+/* append a run record to t, stat'ed */
+static void run_add(struct table_t *t, const struct bin_rec_t *r) {
+    char name[NAME_MAX + 1];
+    uint32_t i = t->n;
+
+    memcpy(name, r + 1, r->name_len);
+    name[r->name_len] = '\0';
+    table_add(t, name, r->name_len, r->type, r->ino);
+    if (t->err == NULL) {
+        table_stat_init(t);
+    }
+    t->err[i] = r->err;
+    t->mode[i] = r->mode;
+    t->nlink[i] = r->nlink;
+    t->uid[i] = r->uid;
+    t->gid[i] = r->gid;
+    t->size[i] = r->size;
+    t->mtime[i] = r->mtime;
+    t->mtime_ns[i] = r->mtime_ns;
+    t->blocks[i] = r->blocks;
+}
 
-    for (i = 0; i < fc; i++) {
-        char *file = files[i];
-        if (skip(file)) continue;
-        if (get_stat(file, &buf) != 0) {
-            err_sys("ls: can not access %s", file);
+/*
+ * Merge the n runs r into the run file fd, or if fd is -1 print them
+ * through t, MERGE_CHUNK entries at a time with the widths w. The merged
+ * runs are closed.
+ */
+static void run_merge(struct run_t *r, int n, int fd, struct table_t *t,
+                      struct widths_t *w) {
+    struct outbuf_t out = {NULL, 0, 0, fd, 0};
+    struct run_t *heap[MERGE_WAYS], *top;
+    struct stimer_t st;
+    int i, nh = 0;
+
+    stats_start(&st);
+    for (i = 0; i < n; i++) {
+        r[i].buf = xrealloc(NULL, RUN_BUFSIZE);
+        r[i].pos = r[i].len = 0;
+        r[i].rec = NULL;
+        if (lseek(r[i].fd, 0, SEEK_SET) == -1) {
+            err_sys("ls: can not read a temporary file");
+            exit(1);
+        }
+        run_next(&r[i]);
+        if (r[i].rec != NULL) heap[nh++] = &r[i];
+    }
+    for (i = nh / 2 - 1; i >= 0; i--) {
+        run_down(heap, nh, i);
+    }
+    while (nh > 0) {
+        top = heap[0];
+        if (fd != -1) {
+            out_mem(&out, (const char*)top->rec, top->rec->len);
         } else {
-            pr_line(&buf, file);
+            run_add(t, top->rec);
+            /* the read buffers take the other half of the budget */
+            if (t->n == MERGE_CHUNK ||
+                arena_used(t->arena) >= g_args.max_memory / 2) {
+                print_range(&g_out, t, 0, t->n, w);
+                table_reset(t);
+            }
+        }
+        run_next(top);
+        if (top->rec == NULL) {
+            heap[0] = heap[--nh];
         }
+        run_down(heap, nh, 0);
+    }
+    if (fd != -1) {
+        out_flush(&out);
+        free(out.buf);
+    } else if (t->n > 0) {
+        print_range(&g_out, t, 0, t->n, w);
+        table_reset(t);
+    }
+    for (i = 0; i < n; i++) {
+        close(r[i].fd);
+        free(r[i].buf);
     }
+    stats_end(&st, PH_SORT);
 }
 
-static char** listdir(char *dir, int *pn) {
-    char **files;
-    int n = 32, off = 0;
-    DIR *dp;
-    struct dirent *dirp;
+/* merge the last ways runs of rs into one */
+static void runs_collapse(struct runs_t *rs) {
+    struct run_t *r = rs->r + rs->n - rs->ways;
+    int fd = run_create(), level = r[rs->ways-1].level + 1;
 
-    files = malloc(sizeof(char*) * n);
-    if (files == NULL) {
-        err_sys("ls: no memory");
-        exit(1);
+    run_merge(r, rs->ways, fd, NULL, NULL);
+    r->fd = fd;
+    r->level = level;
+    rs->n -= rs->ways - 1;
+}
+
+/*
+ * Sort the entries of t into a new run and empty t. w is widened to fit
+ * them, since the lines are only printed once every run is written.
+ */
+static void runs_spill(struct runs_t *rs, struct table_t *t,
+                       struct widths_t *w) {
+    struct arg_t opt = g_args;
+    struct outbuf_t out = {NULL, 0, 0, -1, 0};
+    struct fmtctx_t c = {.opt = &opt, .out = &out, .w = w};
+    struct stimer_t st;
+    uint32_t k;
+
+    table_filter(t);
+    if (t->n == 0) {
+        table_reset(t);
+        return;
     }
-    dp = opendir(dir);
-    if (dp == NULL) {
-        err_sys("ls: can not access %s", dir);
-        return NULL;
+    stat_range(t, 0, t->n);
+    sort(t, t->arena);
+    if (g_args.format == FMT_TEXT && !g_args.shortfmt) {
+        widths_update(&c, t, 0, t->n);
     }
-    while ((dirp = readdir(dp)) != NULL) {
-        if (off >= n) {
-            n *= 2;
-            files = realloc(files, sizeof(char*) * n);
-        }
-        files[off++] = strdup(dirp->d_name);
+    stats_start(&st);
+    if (rs->n == rs->cap) {
+        rs->cap = rs->cap ? 2 * rs->cap : 16;
+        rs->r = xrealloc(rs->r, sizeof(struct run_t) * rs->cap);
+    }
+    out.fd = rs->r[rs->n].fd = run_create();
+    rs->r[rs->n].level = 0;
+    rs->n++;
+    opt.owner_names = 0;
+    for (k = 0; k < t->n; k++) {
+        pr_binary(&c, t, t->order[k], "", -1);
+    }
+    out_flush(&out);
+    free(out.buf);
+    table_reset(t);
+    stats_end(&st, PH_SORT);
+    /* ways runs of a level make one of the next, as in a binary counter */
+    while (rs->n >= rs->ways &&
+           rs->r[rs->n - rs->ways].level == rs->r[rs->n - 1].level) {
+        runs_collapse(rs);
     }
-    closedir(dp);
-    *pn = off;
-    return files;
 }
 
+/* arena bytes t will hold once it is stat'ed and sorted */
+static size_t table_bytes(struct table_t *t) {
+    size_t entry = 5 * sizeof(uint32_t) + 3 * sizeof(int64_t) + sizeof(int) +
+                   sizeof(uint32_t) + 2 * sizeof(struct skey_t);
 
-static void do_dirs(char **dirs, int dc) {
-    int i;
-    char *cwd;
+    return arena_used(t->arena) + (t->err == NULL ? entry * t->cap : 0);
+}
 
-    cwd = malloc(4096 * sizeof(char));
-    if (getcwd(cwd, 4096) == NULL) {
-        err_sys("ls: can not get current dir");
-        exit(1);
+/*
+ * Sorted listing of dir within g_args.max_memory. A directory that fits
+ * is listed as do_files() lists it, a larger one goes through runs.
+ */
+static void budget_dir(char *dir) {
+    struct runs_t rs = {NULL, 0, 0, 0};
+    struct table_t t;
+    struct widths_t w;
+    size_t batch, now, last = 0;
+    int i, ret;
+
+    if (table_open(&t, AT_FDCWD, dir, &g_arena) != 0) {
+        err_sys("ls: can not access %s", dir);
+        return;
+    }
+    /* a batch takes a few times its dirent bytes once in the table */
+    batch = g_args.max_memory / 8;
+    if (batch > DENTS_BUFSIZE) batch = DENTS_BUFSIZE;
+    if (batch < 32 * ONE_KB) batch = 32 * ONE_KB;
+    rs.ways = g_args.max_memory / (2 * RUN_BUFSIZE);
+    if (rs.ways > MERGE_WAYS) rs.ways = MERGE_WAYS;
+    if (rs.ways < 2) rs.ways = 2;
+    /* doubling blocks would overshoot the budget by up to as much again */
+    arena_limit(&g_arena, batch);
+    widths_init(&w);
+    while ((ret = table_read_max(&t, batch)) > 0) {
+        /* spill when the next batch is likely to take t past the budget */
+        now = table_bytes(&t);
+        if (now + (now - last) >= g_args.max_memory) {
+            runs_spill(&rs, &t, &w);
+            now = 0;
+        }
+        last = now;
+    }
+    if (ret == -1) {
+        err_sys("ls: can not read %s", dir);
+        for (i = 0; i < rs.n; i++) {
+            close(rs.r[i].fd);
+        }
+    } else if (rs.n == 0) {
+        pr_header(dir);
+        do_files(&t);
+        if (g_args.cache != NULL) {
+            cache_save(&t);
+        }
+    } else {
+        runs_spill(&rs, &t, &w);
+        while (rs.n > rs.ways) {
+            runs_collapse(&rs);
+        }
+        pr_header(dir);
+        run_merge(rs.r, rs.n, -1, &t, &w);
     }
+    free(rs.r);
+    table_close(&t);
+    arena_reset(&g_arena);
+    arena_limit(&g_arena, ARENA_MAX_BLOCK);
+}
+
+static void do_dirs(struct table_t *dirs) {
+    struct table_t t;
+    uint32_t k;
 
-    for (i = 0; i < dc; i++) {
-        char *dir = dirs[i], **files;
-        int fc, j;
+    /* the walkers list several plain listings at once too */
+    if (g_args.recursive || g_args.du ||
+        (dirs->n > 1 && !g_args.unsorted && g_args.head == 0 &&
+         g_args.cache == NULL && g_args.max_memory == 0 && job_count() > 1)) {
+        walk(dirs);
+        return;
+    }
+    for (k = 0; k < dirs->n; k++) {
+        char *dir = tname(dirs, dirs->order ? dirs->order[k] : k);
 
-        files = listdir(dir, &fc);
-        if (files == NULL) {
+        if (g_args.unsorted) {
+            stream_dir(dir);
             continue;
         }
-        sort(files, fc);
-        if (chdir(dir) != 0) {
-            err_sys("ls: can not chdir");
-            goto cleanup;
+        if (g_args.cache != NULL && cache_print(dir) == 0) {
+            continue;
         }
-        if (dc > 0 && g_args.fc > 1) {
-            fprintf(stdout, "\n%s:\n", dir);
+        if (g_args.head != 0) {
+            head_dir(dir);
+            continue;
         }
-        do_files(files, fc);
-        if (chdir(cwd) != 0) {
-            err_sys("ls: can not chdir");
-            exit(1);
+        if (g_args.max_memory != 0) {
+            budget_dir(dir);
+            continue;
+        }
+        if (listdir(dir, &t, &g_arena) != 0) {
+            arena_reset(&g_arena);
+            continue;
         }
-cleanup:
-        for (j = 0; j < fc; j++) {
-            free(files[j]);
+        pr_header(dir);
+        do_files(&t);
+        if (g_args.cache != NULL) {
+            cache_save(&t);
         }
-        free(files);
+        table_close(&t);
+        arena_reset(&g_arena);
+    }
+}
+
+static void stats_report(uint64_t start) {
+    struct rusage ru;
+    uint64_t nsys = 0, hits, misses;
+    int i;
+
+    stats_flush();
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "%-16s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (i = 0; i < PH_N; i++) {
+        fprintf(stderr, "%-16s %12.3f %12.3f\n", ph_names[i],
+                g_stats.wall[i] / 1e6, g_stats.cpu[i] / 1e6);
     }
-    free(cwd);
+    fprintf(stderr, "%-16s %12.3f %12.3f\n", "total",
+            (clock_ns(CLOCK_MONOTONIC) - start) / 1e6,
+            (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 +
+            (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3);
+    for (i = 0; i < SC_N; i++) {
+        fprintf(stderr, "%-16s %12lu\n", sc_names[i],
+                (unsigned long)g_stats.sys[i]);
+        nsys += g_stats.sys[i];
+    }
+    fprintf(stderr, "%-16s %12lu\n", "syscalls", (unsigned long)nsys);
+    for (i = 0; i < 2; i++) {
+        hits = g_stats.id_hits[i];
+        misses = g_stats.id_misses[i];
+        fprintf(stderr, "%-16s %12lu hits %lu misses (%.1f%% hits)\n",
+                i == 0 ? "users" : "groups", (unsigned long)hits,
+                (unsigned long)misses,
+                hits + misses == 0 ? 0 : 100.0 * hits / (hits + misses));
+    }
+    fprintf(stderr, "%-16s %12lu calls\n", "localtime",
+            (unsigned long)g_stats.localtime);
+    fprintf(stderr, "%-16s %12lu bytes\n", "written",
+            (unsigned long)g_stats.written);
+    fprintf(stderr, "%-16s %12lu bytes\n", "arena peak",
+            (unsigned long)g_arena_peak);
+    fprintf(stderr, "%-16s %12ld KB\n", "max rss", ru.ru_maxrss);
 }
 
 int main(int argc, char **argv) {
-    char **dirs, **files;
-    int fc, dc;
+    struct arena_t a; /* the arguments, g_arena is reset between dirs */
+    struct table_t dirs, files;
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
 
     if (parse_args(argc, argv) != 0) {
         usage();
@@ -382,22 +4728,44 @@ int main(int argc, char **argv) {
 #ifdef DEBUG
     /*dump_opts();*/
 #endif
-
-    dirs = malloc(sizeof(char*) * g_args.fc);
-    files = malloc(sizeof(char*) * g_args.fc);
-    if (dirs == NULL || files == NULL) {
-        free(dirs);
-        free(files);
-        return 1;
+    if (g_args.cache != NULL && !cache_usable()) {
+        g_args.cache = NULL; /* it would print stale stat data */
     }
-    classify(dirs, &dc, files, &fc);
 
-    sort(files, fc);
-    sort(dirs, dc);
-    do_files(files, fc);
-    do_dirs(dirs, dc);
+    arena_init(&a, ARENA_BLOCK);
+    table_init(&dirs, &a, AT_FDCWD);
+    table_init(&files, &a, AT_FDCWD);
+    classify(&dirs, &files);
+    g_out.line_flush = isatty(g_out.fd);
 
-    free(dirs);
-    free(files);
+    if (!g_args.unsorted) {
+        if (g_args.sortkey != SORT_NAME) {
+            stat_range(&dirs, 0, dirs.n);
+        }
+        sort(&dirs, &a);
+    }
+    if (g_args.watch) {
+        if (g_args.format != FMT_TEXT) {
+            fprintf(stderr, "ls: --watch only prints text\n");
+            return 1;
+        }
+        if (dirs.n != 1 || files.n != 0) {
+            fprintf(stderr, "ls: --watch takes a single directory\n");
+            return 1;
+        }
+        watch(tname(&dirs, 0));
+    } else {
+        do_files(&files);
+        do_dirs(&dirs);
+    }
+    out_flush(&g_out);
+    if (g_args.stats) {
+        stats_report(start);
+    }
+    arena_free(&a);
+    free(t_dents);
+#ifdef HAVE_IO_URING
+    uring_free(t_ring);
+#endif
     return EXIT_SUCCESS;
 }